@@ -0,0 +1,49 @@
+#include "arena.hpp"
+#include <algorithm>
+#include <cstdint>
+
+Arena::Arena(std::size_t blockSize) :
+	cur(0),
+	offset(0),
+	blockSize(blockSize) {}
+
+std::size_t Arena::capacity() const {
+	std::size_t total = 0;
+	for (auto& b : blocks)
+		total += b.size;
+	return total;
+}
+
+// Bump-allocate from the current block, moving on to the next block
+// (or creating one) when the request doesn't fit
+void* Arena::do_allocate(std::size_t bytes, std::size_t align) {
+	while (cur < blocks.size()) {
+		Block& b = blocks[cur];
+		std::uintptr_t base = reinterpret_cast<std::uintptr_t>(b.data.get());
+		std::uintptr_t ptr = (base + offset + align - 1) & ~(std::uintptr_t)(align - 1);
+		if (ptr + bytes <= base + b.size) {
+			offset = ptr - base + bytes;
+			return reinterpret_cast<void*>(ptr);
+		}
+		// Blocks left over from earlier, larger iterations are reused
+		// only if the request fits; otherwise a new block is slotted in
+		if (cur + 1 < blocks.size() && blocks[cur + 1].size >= bytes + align) {
+			cur++;
+			offset = 0;
+		} else
+			break;
+	}
+
+	std::size_t size = std::max(blockSize, bytes + align);
+	Block b = { std::unique_ptr<char[]>(new char[size]), size };
+	std::size_t pos = blocks.empty() ? 0 : cur + 1;
+	blocks.insert(blocks.begin() + pos, std::move(b));
+	cur = pos;
+	offset = 0;
+	return do_allocate(bytes, align);
+}
+
+Arena& Arena::local() {
+	static thread_local Arena arena;
+	return arena;
+}
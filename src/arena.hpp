@@ -0,0 +1,68 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+// Monotonic allocator for short-lived generation temporaries.
+// Allocation is a pointer bump; memory is reclaimed all at once by rewinding,
+// and blocks are kept around so the next iteration reuses them.
+class Arena : public std::pmr::memory_resource {
+public:
+	explicit Arena(std::size_t blockSize = 1 << 20);
+	~Arena() = default;
+	// Disallow copy
+	Arena(const Arena& other) = delete;
+	Arena& operator=(const Arena& other) = delete;
+
+	// Position in the arena that can be rewound to later
+	struct Marker {
+		std::size_t block;
+		std::size_t offset;
+	};
+	Marker mark() const { return { cur, offset }; }
+	void rewind(Marker m) { cur = m.block; offset = m.offset; }
+	void reset() { rewind({ 0, 0 }); }
+
+	// Total bytes reserved across all blocks
+	std::size_t capacity() const;
+
+	// Arena belonging to the calling thread
+	static Arena& local();
+
+private:
+	struct Block {
+		std::unique_ptr<char[]> data;
+		std::size_t size;
+	};
+
+	std::vector<Block> blocks;
+	std::size_t cur;			// Index of the block being allocated from
+	std::size_t offset;			// Bytes used in the current block
+	std::size_t blockSize;		// Minimum size of newly created blocks
+
+	void* do_allocate(std::size_t bytes, std::size_t align) override;
+	void do_deallocate(void*, std::size_t, std::size_t) override {}
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+		return this == &other; }
+};
+
+// Rewinds an arena to where it was when the scope was entered
+class ArenaScope {
+public:
+	explicit ArenaScope(Arena& arena = Arena::local()) :
+		arena(arena), marker(arena.mark()) {}
+	~ArenaScope() { arena.rewind(marker); }
+	ArenaScope(const ArenaScope& other) = delete;
+	ArenaScope& operator=(const ArenaScope& other) = delete;
+
+	Arena& get() { return arena; }
+
+private:
+	Arena& arena;
+	Arena::Marker marker;
+};
+
+#endif
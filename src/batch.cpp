@@ -0,0 +1,382 @@
+#include "batch.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include "arena.hpp"
+#include "scheduler.hpp"
+
+// The lane kernel is built for AVX whatever the compiler's target, and
+// only called when the processor has it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LANE_KERNEL __attribute__((target("avx")))
+#define HAVE_LANE_KERNEL 1
+#elif defined(_MSC_VER) && defined(__AVX__)
+#include <immintrin.h>
+#define LANE_KERNEL
+#define HAVE_LANE_KERNEL 1
+#endif
+
+void generateBatch(const CompiledGrammar& model, unsigned int iter,
+	const std::vector<unsigned int>& seeds,
+	const std::function<void(size_t index, const IterGeometry& geom)>& sink,
+	JobControl* ctl) {
+
+	// Refuse before deriving if the rules say a variant will not fit
+	if (Generator(model).predictBytes(iter) > Generator::MAX_BUF)
+		throw std::runtime_error("geometry exceeds maximum buffer size");
+
+	// One task per variant; the stages inside each variant fork further
+	// tasks of their own, which idle threads steal
+	TaskGroup group(TaskScheduler::global(), ctl ? &ctl->cancelled : nullptr);
+	for (size_t i = 0; i < seeds.size(); i++) {
+		group.run([&, i] {
+			Generator gen(model);
+			gen.seed = seeds[i];
+			IterGeometry geom = gen.generateOnly(iter, ctl);
+			sink(i, geom);
+		});
+	}
+	group.wait();
+	if (ctl && ctl->cancelled)
+		throw GenerationCancelled();
+}
+
+const size_t SweepProgram::LANES;
+const size_t SweepProgram::LANE_BYTES;
+
+SweepProgram::SweepProgram(const CompiledGrammar& model, std::string_view string) :
+	segments{ 0, 0, 0, 0 },
+	depth(0) {
+
+	for (int i = 0; i < 4; i++)
+		colors[i] = model.color(i);
+
+	ops.reserve(string.size());
+	std::string run;
+	std::map<std::string, uint32_t> runIndex;
+	size_t level = 0;
+	for (size_t i = 0; i <= string.size(); i++) {
+		char c = i < string.size() ? string[i] : '\0';
+		if (c == '+' || c == '-' || c == '*' || c == '^') {
+			run += c;
+			continue;
+		}
+		if (!run.empty()) {
+			// Identical runs share a rotation
+			auto it = runIndex.emplace(run, (uint32_t)turnRuns.size());
+			if (it.second)
+				turnRuns.push_back(run);
+			ops.push_back(TURN | it.first->second << 2);
+			run.clear();
+		}
+		switch (c) {
+		case '\0':
+		case 'N': case 'n': case 'p': case 'o': case 'i': case 's': case 'S':
+			break;
+		case '[':
+			ops.push_back(PUSH);
+			depth = std::max(depth, ++level);
+			break;
+		case ']':
+			ops.push_back(POP);
+			level--;
+			break;
+		default: {
+			int k = symbolCategory(c);
+			ops.push_back(DRAW | k << 2);
+			segments[k]++;
+			break; }
+		}
+	}
+}
+
+std::vector<glm::mat3> SweepProgram::rotations(float angle1, float angle2) const {
+	glm::mat3 turns[4] = { Generator::rotate(angle1, 1), Generator::rotate(-angle1, 1),
+		Generator::rotate(angle2, 2), Generator::rotate(-angle2, 2) };
+	std::vector<glm::mat3> runs(turnRuns.size(), glm::mat3(1.f));
+	for (size_t i = 0; i < turnRuns.size(); i++) {
+		for (char c : turnRuns[i])
+			runs[i] *= turns[c == '+' ? 0 : c == '-' ? 1 : c == '*' ? 2 : 3];
+	}
+	return runs;
+}
+
+void SweepProgram::layout(IterGeometry& out, size_t first[4]) const {
+	// Categories are laid out trunk, branch, twig, leaf
+	out.trunk = 2 * segments[0];
+	out.branch = 2 * segments[1];
+	out.twig = 2 * segments[2];
+	// Vertices start out coloured, so interpreting only writes positions
+	out.owned.clear();
+	out.owned.reserve(2 * (segments[0] + segments[1] + segments[2] + segments[3]));
+	for (int k = 0; k < 4; k++) {
+		first[k] = out.owned.size();
+		out.owned.insert(out.owned.end(), 2 * segments[k], LineData(glm::vec3(0.f), colors[k]));
+	}
+}
+
+void SweepProgram::run(float angle1, float angle2, IterGeometry& out) const {
+	std::vector<glm::mat3> runs = rotations(angle1, angle2);
+	size_t first[4];
+	layout(out, first);
+	LineData* next[4];
+	for (int k = 0; k < 4; k++)
+		next[k] = out.owned.data() + first[k];
+
+	glm::vec3 pos(0, 1, 0);
+	glm::mat3 rot(1.f);
+	std::vector<std::pair<glm::vec3, glm::mat3>> stack;
+	stack.reserve(depth);
+	for (uint32_t op : ops) {
+		switch (op & 3) {
+		case DRAW: {
+			LineData*& v = next[op >> 2];
+			(v++)->pos = pos;
+			pos += rot[1];			// rot * (0, 1, 0)
+			(v++)->pos = pos;
+			break; }
+		case PUSH:
+			stack.emplace_back(pos, rot);
+			break;
+		case POP:
+			pos = stack.back().first;
+			rot = stack.back().second;
+			stack.pop_back();
+			break;
+		case TURN:
+			rot *= runs[op >> 2];
+			break;
+		}
+	}
+	out.verts = out.owned.data();
+	out.count = out.owned.size();
+}
+
+#ifdef HAVE_LANE_KERNEL
+namespace {
+
+// Interpret ops for LANES turtles side by side, one register lane each:
+// positions and rotations are held by component, so a step is three adds
+// and a turn a 3x3 product for every turtle at once. runs holds each turn
+// run's rotation by component, then lane. Products are summed in glm's
+// order and never fused, so each lane matches the scalar interpreter bit
+// for bit. Only lanes below count are written out; base[l] + first[k] is
+// where lane l's category k starts, already coloured.
+LANE_KERNEL void interpretLanes(const std::vector<uint32_t>& ops, const float* runs, size_t depth,
+	size_t count, LineData* const* base, const size_t* first) {
+
+	const size_t W = SweepProgram::LANES;
+	__m256 px = _mm256_setzero_ps(), py = _mm256_set1_ps(1.f), pz = _mm256_setzero_ps();
+	__m256 r[9];	// Column-major, as glm::mat3
+	for (int j = 0; j < 9; j++)
+		r[j] = j % 4 == 0 ? _mm256_set1_ps(1.f) : _mm256_setzero_ps();
+
+	// A level is position then rotation, 12 registers
+	std::vector<float> stack(depth * 12 * W);
+	float* top = stack.data();
+	size_t next[4] = { first[0], first[1], first[2], first[3] };
+	alignas(32) float from[3][W], to[3][W];
+
+	for (uint32_t op : ops) {
+		switch (op & 3) {
+		case 0: {	// DRAW
+			uint32_t k = op >> 2;
+			_mm256_store_ps(from[0], px);
+			_mm256_store_ps(from[1], py);
+			_mm256_store_ps(from[2], pz);
+			px = _mm256_add_ps(px, r[3]);	// rot * (0, 1, 0)
+			py = _mm256_add_ps(py, r[4]);
+			pz = _mm256_add_ps(pz, r[5]);
+			_mm256_store_ps(to[0], px);
+			_mm256_store_ps(to[1], py);
+			_mm256_store_ps(to[2], pz);
+			for (size_t l = 0; l < count; l++) {
+				LineData* v = base[l] + next[k];
+				v[0].pos = glm::vec3(from[0][l], from[1][l], from[2][l]);
+				v[1].pos = glm::vec3(to[0][l], to[1][l], to[2][l]);
+			}
+			next[k] += 2;
+			break; }
+		case 1:		// PUSH
+			_mm256_storeu_ps(top, px);
+			_mm256_storeu_ps(top + W, py);
+			_mm256_storeu_ps(top + 2 * W, pz);
+			for (int j = 0; j < 9; j++)
+				_mm256_storeu_ps(top + (3 + j) * W, r[j]);
+			top += 12 * W;
+			break;
+		case 2:		// POP
+			top -= 12 * W;
+			px = _mm256_loadu_ps(top);
+			py = _mm256_loadu_ps(top + W);
+			pz = _mm256_loadu_ps(top + 2 * W);
+			for (int j = 0; j < 9; j++)
+				r[j] = _mm256_loadu_ps(top + (3 + j) * W);
+			break;
+		case 3: {	// TURN
+			const float* m = runs + (size_t)(op >> 2) * 9 * W;
+			__m256 a[9];
+			for (int j = 0; j < 9; j++)
+				a[j] = r[j];
+			for (int c = 0; c < 3; c++) {
+				__m256 b0 = _mm256_loadu_ps(m + (c * 3) * W);
+				__m256 b1 = _mm256_loadu_ps(m + (c * 3 + 1) * W);
+				__m256 b2 = _mm256_loadu_ps(m + (c * 3 + 2) * W);
+				for (int row = 0; row < 3; row++)
+					r[c * 3 + row] = _mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(a[row], b0), _mm256_mul_ps(a[3 + row], b1)),
+						_mm256_mul_ps(a[6 + row], b2));
+			}
+			break; }
+		}
+	}
+}
+
+}
+#endif
+
+bool SweepProgram::vectorized() {
+#if defined(HAVE_LANE_KERNEL) && defined(__GNUC__)
+	static const bool avx = __builtin_cpu_supports("avx");
+	return avx;
+#elif defined(HAVE_LANE_KERNEL)
+	return true;
+#else
+	return false;
+#endif
+}
+
+size_t SweepProgram::lanes() const {
+	if (!vectorized())
+		return 1;
+	size_t bytes = 2 * (segments[0] + segments[1] + segments[2] + segments[3]) * sizeof(LineData);
+	return std::clamp(LANE_BYTES / std::max<size_t>(bytes, 1), (size_t)1, LANES);
+}
+
+void SweepProgram::run(const glm::vec2* angles, size_t count, IterGeometry* out) const {
+	count = std::min(count, LANES);
+	if (count < 2 || !vectorized()) {
+		for (size_t l = 0; l < count; l++)
+			run(angles[l].x, angles[l].y, out[l]);
+		return;
+	}
+
+#ifdef HAVE_LANE_KERNEL
+	// Spare lanes repeat the last pair and are not written out
+	const size_t W = LANES;
+	std::vector<float> runs(turnRuns.size() * 9 * W);
+	LineData* base[LANES];
+	size_t first[4];
+	for (size_t l = 0; l < W; l++) {
+		const glm::vec2& a = angles[std::min(l, count - 1)];
+		std::vector<glm::mat3> rot = rotations(a.x, a.y);
+		for (size_t i = 0; i < rot.size(); i++) {
+			for (int j = 0; j < 9; j++)
+				runs[(i * 9 + j) * W + l] = rot[i][j / 3][j % 3];
+		}
+		if (l < count) {
+			layout(out[l], first);
+			base[l] = out[l].owned.data();
+		}
+	}
+	interpretLanes(ops, runs.data(), depth, count, base, first);
+	for (size_t l = 0; l < count; l++) {
+		out[l].verts = out[l].owned.data();
+		out[l].count = out[l].owned.size();
+	}
+#endif
+}
+
+void generateSweep(Generator& gen, unsigned int iter, const std::vector<glm::vec2>& angles,
+	const std::function<void(size_t index, const IterGeometry& geom)>& sink,
+	JobControl* ctl) {
+
+	const CompiledGrammar& model = gen.getModel();
+	const std::atomic<bool>* cancelled = ctl ? &ctl->cancelled : nullptr;
+	if (gen.predictBytes(iter) > Generator::MAX_BUF)
+		throw std::runtime_error("geometry exceeds maximum buffer size");
+
+	// Parametric turns and lengths are not in the compiled program, so
+	// interpret the module string again for each frame
+	if (model.parametric()) {
+		ModuleString modules;
+		gen.deriveOnly(iter, modules, ctl);
+		parallelFor(0, angles.size(), 1, [&](size_t i, size_t) {
+			Generator g(model);
+			g.seed = gen.seed;
+			g.angle1 = angles[i].x;
+			g.angle2 = angles[i].y;
+			ArenaScope scope;
+			IterGeometry geom;
+			geom.iter = iter;
+			geom.owned = g.createGeometry(modules, iter, geom.trunk, geom.branch, geom.twig, nullptr,
+				std::pmr::get_default_resource());
+			geom.verts = geom.owned.data();
+			geom.count = geom.owned.size();
+			sink(i, geom);
+		}, cancelled);
+		if (ctl && ctl->cancelled)
+			throw GenerationCancelled();
+		return;
+	}
+
+	std::string string;
+	gen.deriveOnly(iter, string, ctl);
+
+	// Segments avoid each other by random nudges, so run the full interpreter
+	if (model.flag(CompiledGrammar::FLAG_CHECK_INTERSECT)) {
+		parallelFor(0, angles.size(), 1, [&](size_t i, size_t) {
+			Generator g(model);
+			g.seed = gen.seed;
+			g.angle1 = angles[i].x;
+			g.angle2 = angles[i].y;
+			ArenaScope scope;
+			IterGeometry geom;
+			geom.iter = iter;
+			geom.owned = g.createGeometry(string, iter, geom.trunk, geom.branch, geom.twig, nullptr,
+				std::pmr::get_default_resource());
+			geom.verts = geom.owned.data();
+			geom.count = geom.owned.size();
+			sink(i, geom);
+		}, cancelled);
+	}
+	else {
+		// Frames go through the program a batch at a time, batches no
+		// wider than keeps every thread busy
+		SweepProgram program(model, string);
+		size_t threads = std::max<size_t>(TaskScheduler::global().concurrency(), 1);
+		size_t width = std::clamp(angles.size() / threads, (size_t)1, program.lanes());
+		parallelFor(0, (angles.size() + width - 1) / width, 1, [&](size_t b, size_t) {
+			size_t lo = b * width;
+			size_t count = std::min(width, angles.size() - lo);
+			IterGeometry geoms[SweepProgram::LANES];
+			for (size_t l = 0; l < count; l++)
+				geoms[l].iter = iter;
+			program.run(&angles[lo], count, geoms);
+			for (size_t l = 0; l < count; l++)
+				sink(lo + l, geoms[l]);
+		}, cancelled);
+	}
+	if (ctl && ctl->cancelled)
+		throw GenerationCancelled();
+}
+
+void writeObj(const std::string& filename, const IterGeometry& geom) {
+	std::unique_ptr<FILE, int (*)(FILE*)> file(std::fopen(filename.c_str(), "wb"), std::fclose);
+	if (!file)
+		throw std::runtime_error("Failed to open " + filename + " for writing");
+
+	// Segments are vertex pairs; OBJ indices start at 1
+	std::fprintf(file.get(), "# %zu segments\n", geom.count / 2);
+	for (size_t i = 0; i < geom.count; i++) {
+		const LineData& v = geom.verts[i];
+		std::fprintf(file.get(), "v %g %g %g %g %g %g\n",
+			v.pos.x, v.pos.y, v.pos.z, v.color.r, v.color.g, v.color.b);
+	}
+	for (size_t i = 0; i + 1 < geom.count; i += 2)
+		std::fprintf(file.get(), "l %zu %zu\n", i + 1, i + 2);
+	if (std::ferror(file.get()))
+		throw std::runtime_error("Failed to write " + filename);
+}
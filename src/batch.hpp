@@ -0,0 +1,80 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "generator.hpp"
+
+// Generate iteration iter of a model once per seed, all in parallel on the
+// task scheduler. Each variant gets its own Generator sharing the compiled
+// model, so nothing is reparsed and no OpenGL is involved. sink receives
+// each variant's index in seeds and its geometry; it is called from worker
+// threads, possibly several at once, and the geometry is freed afterwards.
+// Throws before generating anything if the iteration is predicted not to
+// fit in Generator::MAX_BUF.
+void generateBatch(const CompiledGrammar& model, unsigned int iter,
+	const std::vector<unsigned int>& seeds,
+	const std::function<void(size_t index, const IterGeometry& geom)>& sink,
+	JobControl* ctl = nullptr);
+
+// A derived string compiled for interpreting many times at different
+// angles. Symbols become draw, push, pop and turn ops; runs of turns are
+// merged into one op whose rotation is worked out once per pair of angles,
+// and symbols that do not move the turtle are dropped. Output sizes are
+// known in advance, so each segment is written straight to its place.
+// Models that check intersections are not supported (see generateSweep).
+class SweepProgram {
+public:
+	SweepProgram(const CompiledGrammar& model, std::string_view string);
+
+	static const size_t LANES = 8;				// Pairs of angles interpreted together
+	static const size_t LANE_BYTES = 1 << 20;	// Output a batch should keep in cache
+
+	// Interpret the string with the given angles
+	void run(float angle1, float angle2, IterGeometry& out) const;
+	// Interpret the string with up to LANES pairs of angles at once (x =
+	// angle1, y = angle2) into out[0, count). Every turtle takes the same
+	// ops, so with AVX they advance in lockstep, one register lane each;
+	// otherwise they run one after another. Output matches run() exactly.
+	void run(const glm::vec2* angles, size_t count, IterGeometry* out) const;
+	// Does the batched run() use the vector kernel on this machine?
+	static bool vectorized();
+	// Pairs of angles worth running together: up to LANES, as long as their
+	// output fits in LANE_BYTES. Writing segments is most of the work, and
+	// beyond that it goes to memory instead of cache, costing more than the
+	// shared turns save.
+	size_t lanes() const;
+	size_t opCount() const { return ops.size(); }
+
+private:
+	enum OpKind : uint32_t { DRAW, PUSH, POP, TURN };
+
+	// Rotation of each turn run at a pair of angles
+	std::vector<glm::mat3> rotations(float angle1, float angle2) const;
+	// Size out for the program's segments; first receives where each
+	// category starts in out.owned
+	void layout(IterGeometry& out, size_t first[4]) const;
+
+	// Kind in the low 2 bits; category (DRAW) or turn run index (TURN) above
+	std::vector<uint32_t> ops;
+	std::vector<std::string> turnRuns;	// Distinct runs of '+', '-', '*' and '^'
+	glm::vec3 colors[4];				// Trunk, branch, twig and leaf
+	size_t segments[4];					// Segments drawn per category
+	size_t depth;						// Deepest branch nesting
+};
+
+// Interpret iteration iter of a model once per pair of angles (x = angle1,
+// y = angle2), all in parallel. The string is derived once, with gen's
+// seed and without storing earlier iterations, and compiled once; sink is
+// called as for generateBatch(). Models that check intersections, and
+// parametric models, are interpreted normally for each pair. Refuses
+// iterations predicted not to fit, as generateBatch() does.
+void generateSweep(Generator& gen, unsigned int iter, const std::vector<glm::vec2>& angles,
+	const std::function<void(size_t index, const IterGeometry& geom)>& sink,
+	JobControl* ctl = nullptr);
+
+// Write geometry as a Wavefront OBJ file of line segments, with vertex colours
+void writeObj(const std::string& filename, const IterGeometry& geom);
+
+#endif
@@ -0,0 +1,228 @@
+#include "compiled_grammar.hpp"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include "mapped_file.hpp"
+#include "parametric.hpp"
+
+namespace fs = std::filesystem;
+
+static_assert(sizeof(ModelHeader) % alignof(RuleAlt) == 0, "rule table must follow the header aligned");
+
+// Offset of the first hashed byte (everything after the hash field)
+static const std::size_t HASH_START = offsetof(ModelHeader, hash) + sizeof(uint64_t);
+
+// Lay the grammar out as header, alternative table, then successor text
+CompiledGrammar CompiledGrammar::compile(const Grammar& g) {
+	// Report mistakes in parametric rules now rather than when generating
+	if (!g.modules.empty())
+		ParametricGrammar check(g.modules);
+
+	std::size_t altCount = 0;
+	std::size_t textSize = g.axiom.size() + g.modules.size();
+	bool context = false;
+	for (auto& r : g.rules) {
+		altCount += r.second.size();
+		for (auto& d : r.second) {
+			textSize += d.rule.size();
+			context = context || d.left || d.right;
+		}
+	}
+	std::size_t total = sizeof(ModelHeader) + altCount * sizeof(RuleAlt) + textSize;
+	if (total > UINT32_MAX)
+		throw std::runtime_error("grammar too large to compile");
+
+	// Zero-filled so padding and unused slots hash consistently
+	auto buf = std::make_shared<std::vector<char>>(total, 0);
+	ModelHeader* h = reinterpret_cast<ModelHeader*>(buf->data());
+	RuleAlt* alts = reinterpret_cast<RuleAlt*>(buf->data() + sizeof(ModelHeader));
+	char* text = buf->data() + sizeof(ModelHeader) + altCount * sizeof(RuleAlt);
+
+	std::memcpy(h->magic, "LSB1", 4);
+	h->version = VERSION;
+	h->angle1 = g.angle1;
+	h->angle2 = g.angle2;
+	h->iters = g.iters;
+	h->flags = (g.check_intersect ? FLAG_CHECK_INTERSECT : 0) |
+		(g.show_intersect_color ? FLAG_SHOW_INTERSECT : 0) |
+		(g.modules.empty() ? 0 : FLAG_PARAMETRIC) |
+		(context ? FLAG_CONTEXT : 0);
+	const glm::vec3* colors[4] = { &g.trunk_color, &g.branch_color, &g.twig_color, &g.leaf_color };
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 3; j++)
+			h->colors[i][j] = (*colors[i])[j];
+	h->altCount = (uint32_t)altCount;
+	h->textSize = (uint32_t)textSize;
+
+	uint32_t offset = 0;
+	std::memcpy(text, g.axiom.data(), g.axiom.size());
+	h->axiomOffset = offset;
+	h->axiomLength = (uint32_t)g.axiom.size();
+	offset += h->axiomLength;
+	std::memcpy(text + offset, g.modules.data(), g.modules.size());
+	h->moduleOffset = offset;
+	h->moduleLength = (uint32_t)g.modules.size();
+	offset += h->moduleLength;
+
+	uint32_t a = 0;
+	for (auto& r : g.rules) {
+		// Rules needing both neighbours come first, then one, then none;
+		// each context keeps its alternatives in file order
+		std::vector<const Data*> order;
+		for (auto& d : r.second)
+			order.push_back(&d);
+		std::stable_sort(order.begin(), order.end(), [](const Data* x, const Data* y) {
+			int kx = (x->left != 0) + (x->right != 0), ky = (y->left != 0) + (y->right != 0);
+			if (kx != ky) return kx > ky;
+			return x->left != y->left ? x->left < y->left : x->right < y->right;
+		});
+
+		RuleSlot& slot = h->slots[(unsigned char)r.first];
+		slot.first = a;
+		slot.count = (uint32_t)order.size();
+		for (std::size_t first = 0; first < order.size(); ) {
+			std::size_t end = first + 1;
+			while (end < order.size() && order[end]->left == order[first]->left &&
+				order[end]->right == order[first]->right)
+				end++;
+			double tot_prob = 0;
+			for (std::size_t i = first; i < end; i++)
+				tot_prob += order[i]->prob;
+
+			double max = 0;
+			for (std::size_t i = first; i < end; i++) {
+				const Data& d = *order[i];
+				if (tot_prob > 0)
+					max += 1000 * d.prob / tot_prob;
+				// The last alternative always catches rounding leftovers
+				alts[a].threshold = (i + 1 == end) ? 1000.0 : max;
+				alts[a].offset = offset;
+				alts[a].length = (uint32_t)d.rule.size();
+				alts[a].left = d.left;
+				alts[a].right = d.right;
+				std::memcpy(text + offset, d.rule.data(), d.rule.size());
+				offset += alts[a].length;
+				a++;
+			}
+			first = end;
+		}
+	}
+
+	h->hash = fnv1a(buf->data() + HASH_START, total - HASH_START);
+
+	CompiledGrammar cg;
+	cg.base = buf->data();
+	cg.len = total;
+	cg.owner = std::move(buf);
+	return cg;
+}
+
+bool CompiledGrammar::isCompiled(std::string_view data) {
+	return data.size() >= 4 && std::memcmp(data.data(), "LSB1", 4) == 0;
+}
+
+// Use the mapping in place; only the table bounds are checked
+CompiledGrammar CompiledGrammar::load(std::shared_ptr<const MappedFile> file) {
+	if (file->size() < sizeof(ModelHeader) || !isCompiled(file->view()))
+		throw std::runtime_error("not a compiled model");
+	const ModelHeader* h = reinterpret_cast<const ModelHeader*>(file->data());
+	if (h->version != VERSION)
+		throw std::runtime_error("unsupported compiled model version " + std::to_string(h->version));
+	if (sizeof(ModelHeader) + (uint64_t)h->altCount * sizeof(RuleAlt) + h->textSize != file->size())
+		throw std::runtime_error("compiled model is truncated or corrupt");
+	if ((uint64_t)h->axiomOffset + h->axiomLength > h->textSize ||
+		(uint64_t)h->moduleOffset + h->moduleLength > h->textSize)
+		throw std::runtime_error("compiled model is corrupt");
+
+	const RuleAlt* alts = reinterpret_cast<const RuleAlt*>(file->data() + sizeof(ModelHeader));
+	for (const RuleSlot& s : h->slots)
+		if ((uint64_t)s.first + s.count > h->altCount)
+			throw std::runtime_error("compiled model is corrupt");
+	for (uint32_t i = 0; i < h->altCount; i++)
+		if ((uint64_t)alts[i].offset + alts[i].length > h->textSize)
+			throw std::runtime_error("compiled model is corrupt");
+
+	CompiledGrammar cg;
+	cg.base = file->data();
+	cg.len = file->size();
+	cg.owner = std::move(file);
+	return cg;
+}
+
+// Written to a temporary file that is renamed into place: a viewer may
+// still have the old file mapped, and truncating it would pull the pages
+// out from under that mapping
+void CompiledGrammar::save(const std::string& filename) const {
+	std::string tmp = filename + ".tmp";
+	std::error_code ec;
+	{
+		std::ofstream file(tmp, std::ios::binary);
+		if (!file.is_open())
+			throw std::runtime_error("failed to open " + tmp);
+		file.write(base, len);
+		if (!file) {
+			file.close();
+			fs::remove(tmp, ec);
+			throw std::runtime_error("failed to write " + tmp);
+		}
+	}
+	fs::rename(tmp, filename, ec);
+	if (ec) {
+		fs::remove(tmp, ec);
+		throw std::runtime_error("failed to replace " + filename);
+	}
+}
+
+uint64_t fnv1a(const void* data, std::size_t size, uint64_t hash) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (std::size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+bool CompiledGrammar::stochastic() const {
+	const RuleAlt* a = alts();
+	for (int c = 0; c < 256; c++) {
+		const RuleSlot& s = slot((char)c);
+		for (uint32_t i = s.first + 1; i < s.first + s.count; i++) {
+			if (a[i].left == a[i - 1].left && a[i].right == a[i - 1].right)
+				return true;
+		}
+	}
+	return false;
+}
+
+// Rules are compared by their alternatives' thresholds and successor text,
+// so edits that only move rules around in the file are not changes
+ModelDiff CompiledGrammar::diff(const CompiledGrammar& a, const CompiledGrammar& b) {
+	ModelDiff d;
+	std::memset(&d, 0, sizeof(d));
+	const ModelHeader& ha = a.info();
+	const ModelHeader& hb = b.info();
+	d.same = a.hash() == b.hash() && a.bytes() == b.bytes();
+	d.angles = ha.angle1 != hb.angle1 || ha.angle2 != hb.angle2;
+	d.iters = ha.iters != hb.iters;
+	d.flags = ha.flags != hb.flags;
+	d.colors = std::memcmp(ha.colors, hb.colors, sizeof(ha.colors)) != 0;
+	// Any change to a parametric model's rules counts as a new axiom
+	d.axiom = a.axiom() != b.axiom() || a.moduleSource() != b.moduleSource();
+	for (int c = 0; c < 256; c++) {
+		const RuleSlot& sa = ha.slots[c];
+		const RuleSlot& sb = hb.slots[c];
+		bool changed = sa.count != sb.count;
+		for (uint32_t i = 0; !changed && i < sa.count; i++) {
+			const RuleAlt& ra = a.alts()[sa.first + i];
+			const RuleAlt& rb = b.alts()[sb.first + i];
+			changed = ra.threshold != rb.threshold || ra.left != rb.left || ra.right != rb.right ||
+				a.successor(ra) != b.successor(rb);
+		}
+		d.rules[c] = changed;
+		d.anyRule |= changed;
+	}
+	return d;
+}
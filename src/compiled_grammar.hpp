@@ -0,0 +1,114 @@
+#ifndef COMPILED_GRAMMAR_HPP
+#define COMPILED_GRAMMAR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "grammar.hpp"
+
+class MappedFile;
+
+// Range of alternatives for one predecessor symbol
+struct RuleSlot {
+	uint32_t first;				// Index of first alternative
+	uint32_t count;				// Number of alternatives (0 = symbol is copied)
+};
+
+// One successor alternative
+// Alternatives of a symbol are grouped by context, most specific first,
+// and thresholds run from 0 to 1000 within each group
+struct RuleAlt {
+	double threshold;			// Cumulative probability scaled to [0,1000]
+	uint32_t offset;			// Successor position in the text block
+	uint32_t length;			// Successor length
+	char left;					// Neighbours the rule needs (see NeighbourIndex), 0 for any
+	char right;
+};
+
+// Fixed-size header at the start of a compiled model (.lsb file)
+// Followed by altCount RuleAlts and then textSize bytes of successor text
+struct ModelHeader {
+	char magic[4];				// "LSB1"
+	uint32_t version;
+	uint64_t hash;				// FNV-1a of every byte after this field
+	float angle1;
+	float angle2;
+	uint32_t iters;
+	uint32_t flags;				// FLAG_* bits
+	float colors[4][3];			// Trunk, branch, twig and leaf colors in [0,1]
+	uint32_t axiomOffset;		// Axiom position in the text block
+	uint32_t axiomLength;
+	uint32_t moduleOffset;		// Parametric axiom and rules in the text block
+	uint32_t moduleLength;		// (see Grammar::modules), 0 for plain models
+	uint32_t altCount;
+	uint32_t textSize;
+	RuleSlot slots[256];		// Indexed by unsigned char symbol
+};
+
+// Which parts of a model differ between two versions of it
+struct ModelDiff {
+	bool same;					// Byte-identical models
+	bool angles;
+	bool iters;
+	bool flags;
+	bool colors;
+	bool axiom;
+	bool rules[256];			// Per symbol: its alternatives differ
+	bool anyRule;
+};
+
+// Grammar compiled into flat tables in the .lsb layout
+// The bytes live on the heap or in a memory-mapped file; copies share them.
+class CompiledGrammar {
+public:
+	static const uint32_t VERSION = 3;
+	static const uint32_t FLAG_CHECK_INTERSECT = 1;
+	static const uint32_t FLAG_SHOW_INTERSECT = 2;
+	static const uint32_t FLAG_PARAMETRIC = 4;	// Rewritten from moduleSource(), not the tables
+	static const uint32_t FLAG_CONTEXT = 8;		// Some rules are context-sensitive
+
+	CompiledGrammar() : base(nullptr), len(0) {}
+
+	// Build the tables from a parsed grammar
+	static CompiledGrammar compile(const Grammar& g);
+	// Load a compiled model from a file mapping, validating its layout
+	static CompiledGrammar load(std::shared_ptr<const MappedFile> file);
+	// Does this data start with the compiled model signature?
+	static bool isCompiled(std::string_view data);
+	// Write to a .lsb file
+	void save(const std::string& filename) const;
+	// Compare an old and a new version of a model
+	static ModelDiff diff(const CompiledGrammar& a, const CompiledGrammar& b);
+
+	bool empty() const { return base == nullptr; }
+	const ModelHeader& info() const { return *reinterpret_cast<const ModelHeader*>(base); }
+	uint64_t hash() const { return info().hash; }
+	std::string_view axiom() const { return text(info().axiomOffset, info().axiomLength); }
+	const RuleSlot& slot(char c) const { return info().slots[(unsigned char)c]; }
+	const RuleAlt* alts() const { return reinterpret_cast<const RuleAlt*>(base + sizeof(ModelHeader)); }
+	std::string_view successor(const RuleAlt& alt) const { return text(alt.offset, alt.length); }
+	bool parametric() const { return flag(FLAG_PARAMETRIC); }
+	bool contextual() const { return flag(FLAG_CONTEXT); }
+	// Does some symbol choose between alternatives in the same context?
+	bool stochastic() const;
+	std::string_view moduleSource() const { return text(info().moduleOffset, info().moduleLength); }
+	glm::vec3 color(int i) const {
+		return glm::vec3(info().colors[i][0], info().colors[i][1], info().colors[i][2]); }
+	bool flag(uint32_t f) const { return (info().flags & f) != 0; }
+	std::string_view bytes() const { return std::string_view(base, len); }
+
+private:
+	std::shared_ptr<const void> owner;	// Keeps the bytes alive
+	const char* base;
+	std::size_t len;
+
+	std::string_view text(uint32_t offset, uint32_t length) const {
+		return std::string_view(base + sizeof(ModelHeader) + info().altCount * sizeof(RuleAlt) + offset, length); }
+};
+
+// 64-bit FNV-1a hash, optionally continuing from a previous hash
+uint64_t fnv1a(const void* data, std::size_t size, uint64_t hash = 14695981039346656037ull);
+
+#endif
@@ -0,0 +1,101 @@
+#define NOMINMAX
+#include "context.hpp"
+#include <algorithm>
+#include <utility>
+#include "scheduler.hpp"
+
+namespace {
+
+// Symbols per chunk scanned on its own
+const size_t INDEX_CHUNK = 1 << 16;
+
+bool isTurn(char c) {
+	return c == '+' || c == '-' || c == '*' || c == '^';
+}
+
+// A chunk scanned without knowing what came before it. Values are
+// symbols, or -(k + 1) for the value held k levels up from where the chunk
+// starts: k = 0 is the neighbour carried in, k > 0 the k-th saved one.
+struct Chunk {
+	std::vector<int> saved;		// Values saved by brackets still open at the end
+	int carried;				// Value carried out at the end
+	size_t closed = 0;			// Levels closed that were opened before the chunk
+	std::vector<std::pair<size_t, int>> unknown;	// Positions whose neighbour came from before
+};
+
+// Scan [lo, hi) towards the right for left neighbours, or towards the left
+// for right neighbours. Entering a branch saves the neighbour, which the
+// branch's first symbol still sees on its left but not on its right;
+// leaving it brings the saved one back.
+void scan(std::string_view s, size_t lo, size_t hi, bool forward, char* out, Chunk& ch) {
+	const char enter = forward ? '[' : ']';
+	int value = -1;
+	for (size_t n = lo; n < hi; n++) {
+		size_t i = forward ? n : lo + hi - 1 - n;
+		char c = s[i];
+		out[i] = 0;
+		if (c == enter) {
+			ch.saved.push_back(value);
+			if (!forward) value = 0;
+		}
+		else if (c == '[' || c == ']') {
+			if (ch.saved.empty())
+				value = -(int)(++ch.closed + 1);
+			else {
+				value = ch.saved.back();
+				ch.saved.pop_back();
+			}
+		}
+		else if (!isTurn(c)) {
+			if (value < 0)
+				ch.unknown.emplace_back(i, value);
+			else
+				out[i] = (char)value;
+			value = (unsigned char)c;
+		}
+	}
+	ch.carried = value;
+}
+
+// Pass the state from chunk to chunk in scan order, filling in the
+// neighbours each chunk could not see
+void join(std::vector<Chunk>& chunks, bool forward, char* out) {
+	int carried = 0;
+	std::vector<int> saved;
+	for (size_t n = 0; n < chunks.size(); n++) {
+		Chunk& ch = chunks[forward ? n : chunks.size() - 1 - n];
+		auto resolve = [&](int v) {
+			if (v >= 0) return v;
+			size_t k = (size_t)(-v - 1);
+			if (k == 0) return carried;
+			return k <= saved.size() ? saved[saved.size() - k] : 0;
+		};
+		for (auto& u : ch.unknown)
+			out[u.first] = (char)resolve(u.second);
+		for (int& v : ch.saved)
+			v = resolve(v);
+		carried = resolve(ch.carried);
+		saved.resize(saved.size() - std::min(ch.closed, saved.size()));
+		saved.insert(saved.end(), ch.saved.begin(), ch.saved.end());
+	}
+}
+
+}
+
+NeighbourIndex::NeighbourIndex(std::string_view string, const std::atomic<bool>* cancelled) :
+	lefts(string.size()),
+	rights(string.size()) {
+
+	size_t count = (string.size() + INDEX_CHUNK - 1) / INDEX_CHUNK;
+	std::vector<Chunk> forward(count), backward(count);
+	parallelFor(0, count, 1, [&](size_t k, size_t) {
+		size_t lo = k * INDEX_CHUNK;
+		size_t hi = std::min(string.size(), lo + INDEX_CHUNK);
+		scan(string, lo, hi, true, lefts.data(), forward[k]);
+		scan(string, lo, hi, false, rights.data(), backward[k]);
+	}, cancelled);
+	if (cancelled && *cancelled)
+		return;
+	join(forward, true, lefts.data());
+	join(backward, false, rights.data());
+}
@@ -0,0 +1,31 @@
+#ifndef CONTEXT_HPP
+#define CONTEXT_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+// Left and right neighbours of every symbol of one iteration's string, as
+// context-sensitive rules see them: the nearest symbol on each side on
+// the same branch, skipping whole branches in between. The first symbol
+// of a branch has the symbol before the '[' on its left; the last symbol
+// of a branch has nothing on its right. Turns are passed over.
+// Built once per iteration, in parallel by chunk, so each rule looks its
+// context up in constant time.
+class NeighbourIndex {
+public:
+	NeighbourIndex() {}
+	explicit NeighbourIndex(std::string_view string, const std::atomic<bool>* cancelled = nullptr);
+
+	bool empty() const { return lefts.empty(); }
+	// Neighbours of the symbol at i, 0 where there is none
+	char left(size_t i) const { return lefts[i]; }
+	char right(size_t i) const { return rights[i]; }
+
+private:
+	std::vector<char> lefts;
+	std::vector<char> rights;
+};
+
+#endif
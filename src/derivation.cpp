@@ -0,0 +1,164 @@
+#define NOMINMAX
+#include "derivation.hpp"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include "generator.hpp"
+#include "scheduler.hpp"
+
+// Ranges per thread when deriving a whole string
+static const size_t PARTS_PER_THREAD = 16;
+// Output bytes below which splitting further is not worth it
+static const uint64_t MIN_PART = 1 << 14;
+
+bool DirectDerivation::supports(const CompiledGrammar& model) {
+	if (model.parametric() || model.contextual())
+		return false;
+	for (int c = 0; c < 256; c++) {
+		if (model.slot((char)c).count > 1)
+			return false;
+	}
+	return true;
+}
+
+// Lengths add up along a sequence, stopping at the largest value
+// Only symbols that cannot occur in the iteration can saturate, unless the
+// whole string is too long, which the constructor rejects
+static std::vector<uint64_t> prefixSums(std::string_view symbols, const uint64_t* lengths) {
+	std::vector<uint64_t> starts(symbols.size() + 1, 0);
+	for (size_t i = 0; i < symbols.size(); i++) {
+		uint64_t n = lengths[(unsigned char)symbols[i]];
+		starts[i + 1] = starts[i] > std::numeric_limits<uint64_t>::max() - n ?
+			std::numeric_limits<uint64_t>::max() : starts[i] + n;
+	}
+	return starts;
+}
+
+DirectDerivation::DirectDerivation(CompiledGrammar m, unsigned int iter) :
+	model(std::move(m)),
+	iter(iter),
+	lengths((size_t)(iter + 1) * 256, 1),
+	offsets((size_t)(iter + 1) * 256),
+	total(0) {
+
+	if (!supports(model))
+		throw std::runtime_error("direct derivation needs a deterministic model");
+
+	// A symbol with a rule grows to the total of its successor's symbols
+	// one depth lower; symbols without rules stay as they are
+	for (unsigned int d = 1; d <= iter; d++) {
+		for (int c = 0; c < 256; c++) {
+			if (!model.slot((char)c).count) continue;
+			auto& s = offsets[(size_t)d * 256 + c];
+			s = prefixSums(successor((char)c), &lengths[(size_t)(d - 1) * 256]);
+			lengths[(size_t)d * 256 + c] = s.back();
+		}
+	}
+	axiomStarts = prefixSums(model.axiom(), &lengths[(size_t)iter * 256]);
+	total = axiomStarts.back();
+	if (total == std::numeric_limits<uint64_t>::max())
+		throw std::runtime_error("derived string too large to index");
+}
+
+char DirectDerivation::symbolAt(uint64_t pos) const {
+	char c;
+	window(pos, 1, &c);
+	return c;
+}
+
+void DirectDerivation::window(uint64_t pos, uint64_t count, char* out) const {
+	if (pos > total || count > total - pos)
+		throw std::out_of_range("window outside the derived string");
+	range(model.axiom(), axiomStarts, iter, pos, count, out);
+}
+
+std::string DirectDerivation::window(uint64_t pos, uint64_t count) const {
+	std::string s(count, '\0');
+	window(pos, count, &s[0]);
+	return s;
+}
+
+void DirectDerivation::derive(std::string& out, JobControl* ctl) const {
+	if (ctl) ctl->stage = JobControl::REWRITING;
+	if (total > out.max_size())
+		throw std::runtime_error("derived string too large");
+	out.assign(total, '\0');
+
+	// Equal ranges, each found from the axiom on its own
+	uint64_t parts = TaskScheduler::global().concurrency() * PARTS_PER_THREAD;
+	uint64_t size = std::max(MIN_PART, (total + parts - 1) / parts);
+	parts = (total + size - 1) / size;
+	std::atomic<size_t> done(0);
+	parallelFor(0, parts, 1, [&](size_t k, size_t) {
+		uint64_t pos = k * size;
+		range(model.axiom(), axiomStarts, iter, pos, std::min(size, total - pos), &out[pos]);
+		if (ctl) ctl->progress = (float)++done / (float)parts;
+	}, ctl ? &ctl->cancelled : nullptr);
+	if (ctl && ctl->cancelled)
+		throw GenerationCancelled();
+}
+
+// Descend into the symbols overlapping the range, expanding the ones it
+// covers whole
+void DirectDerivation::range(std::string_view symbols, const std::vector<uint64_t>& bounds,
+	unsigned int depth, uint64_t pos, uint64_t count, char* out) const {
+
+	size_t i = std::upper_bound(bounds.begin(), bounds.end(), pos) - bounds.begin() - 1;
+	for (; count > 0; i++) {
+		char c = symbols[i];
+		uint64_t skip = pos - bounds[i];
+		uint64_t n = std::min(count, bounds[i + 1] - pos);
+		if (n == bounds[i + 1] - bounds[i])
+			expand(c, depth, out);
+		else
+			range(successor(c), starts(c, depth), depth - 1, skip, n, out);
+		out += n;
+		pos += n;
+		count -= n;
+	}
+}
+
+// Write the expansion of one symbol, depth first, with a stack of
+// successor positions instead of recursion
+void DirectDerivation::expand(char c, unsigned int depth, char* out) const {
+	if (!depth || !model.slot(c).count) {
+		*out = c;
+		return;
+	}
+
+	struct Frame {
+		const char* pos;
+		const char* end;
+	};
+	std::vector<Frame> stack;
+	stack.reserve(depth);
+	auto push = [&](char s) {
+		std::string_view succ = successor(s);
+		stack.push_back({ succ.data(), succ.data() + succ.size() });
+	};
+	push(c);
+
+	// Symbols in frame k (from the bottom) have depth - k - 1 rewrites left
+	while (!stack.empty()) {
+		Frame& f = stack.back();
+		if (f.pos == f.end) {
+			stack.pop_back();
+			continue;
+		}
+		unsigned int left = depth - (unsigned int)stack.size();
+		if (left == 0) {
+			// Final symbols: copy the rest of the successor in one go
+			size_t n = f.end - f.pos;
+			std::memcpy(out, f.pos, n);
+			out += n;
+			stack.pop_back();
+			continue;
+		}
+		char s = *f.pos++;
+		if (model.slot(s).count)
+			push(s);
+		else
+			*out++ = s;
+	}
+}
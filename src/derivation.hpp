@@ -0,0 +1,58 @@
+#ifndef DERIVATION_HPP
+#define DERIVATION_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "compiled_grammar.hpp"
+
+struct JobControl;
+
+// Index over the derivation of one iteration of a deterministic model.
+// Holds the length of every symbol's expansion at every depth, so any
+// symbol or range of the iteration's string can be produced straight from
+// the axiom by descending the derivation tree, without building the string
+// or the iterations before it. Whole strings are derived as balanced
+// ranges expanded in parallel straight into place.
+class DirectDerivation {
+public:
+	DirectDerivation(CompiledGrammar model, unsigned int iter);
+
+	// Only models without stochastic or context-sensitive rules or
+	// parameters can be derived this way
+	static bool supports(const CompiledGrammar& model);
+
+	// Length of the derived string
+	uint64_t length() const { return total; }
+	// Symbol at position pos
+	char symbolAt(uint64_t pos) const;
+	// Write the count symbols from pos to out
+	void window(uint64_t pos, uint64_t count, char* out) const;
+	std::string window(uint64_t pos, uint64_t count) const;
+	// Write the derived string to out, replacing its contents
+	void derive(std::string& out, JobControl* ctl = nullptr) const;
+
+private:
+	uint64_t expansionLength(char c, unsigned int depth) const {
+		return lengths[(size_t)depth * 256 + (unsigned char)c]; }
+	// Starts of each successor symbol's expansion within c's, plus the end
+	const std::vector<uint64_t>& starts(char c, unsigned int depth) const {
+		return offsets[(size_t)depth * 256 + (unsigned char)c]; }
+	std::string_view successor(char c) const {
+		return model.successor(model.alts()[model.slot(c).first]); }
+
+	// Write part of the expansion of symbols whose expansions start at bounds
+	void range(std::string_view symbols, const std::vector<uint64_t>& bounds, unsigned int depth,
+		uint64_t pos, uint64_t count, char* out) const;
+	void expand(char c, unsigned int depth, char* out) const;
+
+	CompiledGrammar model;
+	unsigned int iter;
+	std::vector<uint64_t> lengths;		// By depth, then symbol
+	std::vector<std::vector<uint64_t>> offsets;	// By depth, then symbol; empty without a rule
+	std::vector<uint64_t> axiomStarts;
+	uint64_t total;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#define NOMINMAX
+#include "detail.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include "generator.hpp"
+#include "growth.hpp"
+
+bool SubtreeBounds::supports(const CompiledGrammar& model) {
+	if (model.parametric() || model.contextual())
+		return false;
+	if (model.slot('[').count || model.slot(']').count)
+		return false;
+	for (int c = 0; c < 256; c++) {
+		const RuleSlot& slot = model.slot((char)c);
+		if (slot.count > 1)
+			return false;
+		if (!slot.count) continue;
+		int depth = 0;
+		for (char s : model.successor(model.alts()[slot.first])) {
+			if (s == '[') depth++;
+			else if (s == ']' && --depth < 0) return false;
+		}
+		if (depth) return false;
+	}
+	return true;
+}
+
+SubtreeBounds::SubtreeBounds(const CompiledGrammar& model, unsigned int iter, float angle1, float angle2) :
+	entries((size_t)(iter + 1) * 256) {
+
+	if (!supports(model))
+		throw std::runtime_error("subtree bounds need deterministic, balanced rules");
+
+	// Unexpanded symbols: one unit step, a turn, or nothing
+	glm::mat3 turns[4] = { Generator::rotate(angle1, 1), Generator::rotate(-angle1, 1),
+		Generator::rotate(angle2, 2), Generator::rotate(-angle2, 2) };
+	std::vector<double> segments((size_t)(iter + 1) * 256 * 4, 0.0);
+	for (int c = 0; c < 256; c++) {
+		Entry& e = entries[c];
+		e.rot = glm::mat3(1.f);
+		e.move = glm::vec3(0.f);
+		e.radius = 0.f;
+		e.category = symbolCategory((char)c);
+		switch (c) {
+		case '+': e.rot = turns[0]; break;
+		case '-': e.rot = turns[1]; break;
+		case '*': e.rot = turns[2]; break;
+		case '^': e.rot = turns[3]; break;
+		}
+		if (e.category >= 0) {
+			e.move = glm::vec3(0.f, 1.f, 0.f);
+			e.radius = 1.f;
+			segments[(size_t)c * 4 + e.category] = 1.0;
+		}
+	}
+
+	// Walk each successor with the entries one depth lower, keeping a
+	// local branch stack; symbols without rules keep their depth 0 entry
+	std::vector<std::pair<glm::vec3, glm::mat3>> stack;
+	for (unsigned int d = 1; d <= iter; d++) {
+		const Entry* lower = &entries[(size_t)(d - 1) * 256];
+		const double* lowerSegs = &segments[(size_t)(d - 1) * 256 * 4];
+		for (int c = 0; c < 256; c++) {
+			Entry& e = entries[(size_t)d * 256 + c];
+			double* segs = &segments[((size_t)d * 256 + c) * 4];
+			const RuleSlot& slot = model.slot((char)c);
+			if (!slot.count) {
+				e = entries[c];
+				std::copy(&segments[(size_t)c * 4], &segments[(size_t)c * 4] + 4, segs);
+				continue;
+			}
+			glm::vec3 pos(0.f);
+			glm::mat3 rot(1.f);
+			float radius = 0.f;
+			for (char s : model.successor(model.alts()[slot.first])) {
+				if (s == '[') {
+					stack.emplace_back(pos, rot);
+					continue;
+				}
+				if (s == ']') {
+					pos = stack.back().first;
+					rot = stack.back().second;
+					stack.pop_back();
+					continue;
+				}
+				const Entry& child = lower[(unsigned char)s];
+				if (child.radius > 0.f)
+					radius = std::max(radius, glm::length(pos) + child.radius);
+				pos += rot * child.move;
+				rot *= child.rot;
+				for (int k = 0; k < 4; k++)
+					segs[k] += lowerSegs[(unsigned char)s * 4 + k];
+			}
+			e.rot = rot;
+			e.move = pos;
+			e.radius = radius;
+			e.category = -1;
+			for (int k = 0; k < 4; k++) {
+				if (segs[k] > 0.0 && (e.category < 0 || segs[k] > segs[e.category]))
+					e.category = k;
+			}
+		}
+	}
+}
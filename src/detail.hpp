@@ -0,0 +1,37 @@
+#ifndef DETAIL_HPP
+#define DETAIL_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "compiled_grammar.hpp"
+
+// Where the expansion of each symbol takes the turtle, and how far from
+// its start it can draw, at every depth up to one iteration. Entries are
+// in the frame of the turtle before the symbol: a symbol expanded d times
+// from position p with rotation R ends at p + R * move with rotation
+// R * rot, and draws nothing further than radius from p. Entries compose
+// over successors, so the whole table costs one pass over the rules per
+// depth, and lets a viewer skip subtrees too small to see.
+class SubtreeBounds {
+public:
+	struct Entry {
+		glm::mat3 rot;				// Turn from start to end
+		glm::vec3 move;				// End position
+		float radius;				// Bounding sphere about the start
+		int category;				// Category drawing most segments, -1 if none
+	};
+
+	SubtreeBounds(const CompiledGrammar& model, unsigned int iter, float angle1, float angle2);
+
+	// Needs deterministic context-free rules without parameters whose
+	// successors open and close their own branches, and no rules for '[' or ']'
+	static bool supports(const CompiledGrammar& model);
+
+	const Entry& at(char c, unsigned int depth) const {
+		return entries[(size_t)depth * 256 + (unsigned char)c]; }
+
+private:
+	std::vector<Entry> entries;		// By depth, then symbol
+};
+
+#endif
@@ -0,0 +1,163 @@
+#include "file_watcher.hpp"
+#include <iostream>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// How often the thread wakes to settle files and check for quitting
+static const std::chrono::milliseconds TICK(50);
+// How often the polling fallback rescans the directory
+static const std::chrono::milliseconds SCAN_INTERVAL(500);
+
+FileWatcher::FileWatcher(const std::string& dir, std::chrono::milliseconds debounce) :
+	dir(dir),
+	debounce(debounce),
+	quit(false),
+	fd(-1) {
+
+	std::error_code ec;
+	for (auto& di : fs::directory_iterator(dir, ec)) {
+		if (isModel(di.path())) {
+			known.insert(di.path().string());
+			times[di.path().string()] = di.last_write_time(ec);
+		}
+	}
+
+#ifdef __linux__
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd >= 0 && inotify_add_watch(fd, dir.c_str(),
+			IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM) < 0) {
+		close(fd);
+		fd = -1;
+	}
+#endif
+	if (fd < 0)
+		std::cerr << "Watching " << dir << " by polling" << std::endl;
+
+	thread = std::thread(&FileWatcher::run, this);
+}
+
+FileWatcher::~FileWatcher() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	thread.join();
+#ifdef __linux__
+	if (fd >= 0)
+		close(fd);
+#endif
+}
+
+std::vector<FileWatcher::Event> FileWatcher::poll() {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<Event> events;
+	events.swap(ready);
+	return events;
+}
+
+bool FileWatcher::isModel(const fs::path& p) {
+	return p.extension() == ".txt" || p.extension() == ".lsb";
+}
+
+void FileWatcher::run() {
+	auto lastScan = Clock::now();
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (quit) return;
+		}
+
+#ifdef __linux__
+		if (fd >= 0) {
+			pollfd p = { fd, POLLIN, 0 };
+			if (::poll(&p, 1, (int)TICK.count()) > 0) {
+				alignas(inotify_event) char buf[4096];
+				ssize_t n;
+				while ((n = read(fd, buf, sizeof(buf))) > 0) {
+					for (char* ptr = buf; ptr < buf + n; ) {
+						auto* e = reinterpret_cast<inotify_event*>(ptr);
+						if (e->len && isModel(e->name))
+							touch((fs::path(dir) / e->name).string());
+						ptr += sizeof(inotify_event) + e->len;
+					}
+				}
+			}
+			settle();
+			continue;
+		}
+#endif
+		std::this_thread::sleep_for(TICK);
+		if (Clock::now() - lastScan >= SCAN_INTERVAL) {
+			scan();
+			lastScan = Clock::now();
+		}
+		settle();
+	}
+}
+
+void FileWatcher::touch(const std::string& path) {
+	busy[path] = Clock::now();
+}
+
+// Report files with no activity for the debounce period
+// Whether a file was added, changed or removed is decided here, from its
+// final state, so e.g. save-by-rename shows up as a single change
+void FileWatcher::settle() {
+	auto now = Clock::now();
+	std::vector<Event> events;
+	for (auto it = busy.begin(); it != busy.end(); ) {
+		if (now - it->second < debounce) {
+			++it;
+			continue;
+		}
+		std::error_code ec;
+		bool exists = fs::is_regular_file(it->first, ec);
+		bool wasKnown = known.count(it->first) > 0;
+		if (exists && wasKnown)
+			events.push_back({ Event::CHANGED, it->first });
+		else if (exists) {
+			events.push_back({ Event::ADDED, it->first });
+			known.insert(it->first);
+		}
+		else if (wasKnown) {
+			events.push_back({ Event::REMOVED, it->first });
+			known.erase(it->first);
+		}
+		it = busy.erase(it);
+	}
+
+	if (!events.empty()) {
+		std::lock_guard<std::mutex> lock(mutex);
+		ready.insert(ready.end(), events.begin(), events.end());
+	}
+}
+
+// Compare modification times with the last scan
+void FileWatcher::scan() {
+	std::error_code ec;
+	std::set<std::string> seen;
+	for (auto& di : fs::directory_iterator(dir, ec)) {
+		if (!isModel(di.path())) continue;
+		std::string path = di.path().string();
+		seen.insert(path);
+		auto t = di.last_write_time(ec);
+		auto it = times.find(path);
+		if (it == times.end() || it->second != t) {
+			times[path] = t;
+			touch(path);
+		}
+	}
+	for (auto it = times.begin(); it != times.end(); ) {
+		if (!seen.count(it->first)) {
+			touch(it->first);
+			it = times.erase(it);
+		}
+		else
+			++it;
+	}
+}
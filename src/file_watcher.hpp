@@ -0,0 +1,56 @@
+#ifndef FILE_WATCHER_HPP
+#define FILE_WATCHER_HPP
+
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Watches a directory for model files (.txt and .lsb) being written,
+// added or removed. Uses inotify on Linux and polls modification times
+// elsewhere. Bursts of writes to a file are reported once, after the file
+// has been quiet for the debounce period.
+class FileWatcher {
+public:
+	struct Event {
+		enum Kind { CHANGED, ADDED, REMOVED };
+		Kind kind;
+		std::string path;
+	};
+
+	FileWatcher(const std::string& dir, std::chrono::milliseconds debounce);
+	~FileWatcher();
+	FileWatcher(const FileWatcher& other) = delete;
+	FileWatcher& operator=(const FileWatcher& other) = delete;
+
+	// Events that have settled since the last call
+	std::vector<Event> poll();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	void run();							// Watcher thread body
+	void touch(const std::string& path);	// Note activity on a file
+	void settle();						// Turn files quiet for long enough into events
+	void scan();						// Polling fallback: look for changed files
+	static bool isModel(const std::filesystem::path& p);
+
+	std::string dir;
+	std::chrono::milliseconds debounce;
+	std::thread thread;
+	std::mutex mutex;					// Guards ready and quit
+	std::vector<Event> ready;
+	bool quit;
+
+	// Watcher thread only
+	std::set<std::string> known;		// Model files reported so far
+	std::map<std::string, Clock::time_point> busy;	// Files with recent activity
+	std::map<std::string, std::filesystem::file_time_type> times;	// Polling: last seen mtimes
+	int fd;								// inotify descriptor, or -1 when polling
+};
+
+#endif
@@ -0,0 +1,1190 @@
+#define NOMINMAX
+#include "generator.hpp"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <glm/gtx/transform.hpp>
+#include <glm/gtx/norm.hpp>
+#include "arena.hpp"
+#include "derivation.hpp"
+#include "detail.hpp"
+#include "scheduler.hpp"
+
+// Symbols between cancellation checks and progress updates
+static const size_t CHECK_INTERVAL = 1 << 16;
+// Symbols per parallel rewriting task; each chunk has its own random
+// sequence, so results do not depend on the number of threads
+static const size_t REWRITE_CHUNK = 1 << 16;
+// Symbols per parallel interpretation task
+static const size_t INTERPRET_CHUNK = 1 << 16;
+// Fraction of a model's radius below which the sizing pass of adaptive
+// generation draws proxies
+static const float COARSE_DIVISIONS = 64.f;
+
+// Capacity to reserve for a predicted size; expected sizes of stochastic
+// models get some slack
+static size_t reserveSize(double predicted, bool exact) {
+	return (size_t)(exact ? predicted : predicted * 1.1 + 16);
+}
+
+// Report progress through a string and stop if the job was cancelled
+static void checkJob(JobControl* ctl, size_t done, size_t total) {
+	if (ctl->cancelled)
+		throw GenerationCancelled();
+	ctl->progress = (float)done / (float)total;
+}
+
+// Generator for one part of a seeded run
+// Each (seed, iteration, stream, chunk) gets its own sequence, so any
+// iteration, or any chunk of one, can be regenerated on its own with the
+// same result
+std::mt19937 makeRandom(unsigned int seed, unsigned int iter, unsigned int stream, unsigned int chunk = 0) {
+	std::seed_seq seq = { seed, iter, stream, chunk };
+	return std::mt19937(seq);
+}
+
+int getRandomNumber(std::mt19937& gen, int n) {
+	std::uniform_int_distribution<int> distribution(0, n); // Create a uniform distribution from 0 to n
+
+	return distribution(gen); // Generate a random number within the specified range
+}
+
+bool doLineSegmentsIntersect(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& q0, const glm::vec3& q1) {
+	if (glm::compMax(glm::max(p0, p1)) < glm::compMin(glm::min(q0, q1)) ||
+		glm::compMin(glm::min(p0, p1)) > glm::compMax(glm::max(q0, q1))) {
+		return false; 
+	}
+
+	glm::vec3 cross1 = glm::cross(p1 - p0, q0 - p0);
+	glm::vec3 cross2 = glm::cross(p1 - p0, q1 - p0);
+
+	if (glm::length2(cross1) < glm::epsilon<float>() || glm::length2(cross2) < glm::epsilon<float>()) {
+		return false;
+	}
+
+	glm::vec3 cross3 = glm::cross(q1 - q0, p0 - q0);
+	glm::vec3 cross4 = glm::cross(q1 - q0, p1 - q0);
+
+	return (glm::dot(cross1, cross2) < 0.0f && glm::dot(cross3, cross4) < 0.0f);
+}
+
+Generator::Generator(CompiledGrammar model) :
+	angle1(model.info().angle1),
+	angle2(model.info().angle2),
+	seed(std::random_device()()),
+	cache(nullptr),
+	model(std::move(model)),
+	growth(this->model),
+	strings({ std::string(this->model.axiom()) }),
+	stringBytes(strings[0].capacity()),
+	trunk_color(this->model.color(0)),
+	branch_color(this->model.color(1)),
+	twig_color(this->model.color(2)),
+	leaf_color(this->model.color(3)),
+	check_intersect(this->model.flag(CompiledGrammar::FLAG_CHECK_INTERSECT)),
+	show_intersect_color(this->model.flag(CompiledGrammar::FLAG_SHOW_INTERSECT)) {
+
+	if (this->model.parametric()) {
+		loadModules();
+		stringBytes += moduleStrings[0].capacity() * sizeof(uint32_t);
+	}
+}
+
+// Parametric models keep module strings instead of character strings,
+// and predict growth from their own rules
+void Generator::loadModules() {
+	modules = std::make_shared<const ParametricGrammar>(model.moduleSource());
+	growth = GrowthPredictor(*modules);
+	moduleStrings.assign(1, modules->axiom());
+}
+
+// Take settings from the new model; strings from keep on are rederived
+void Generator::setModel(CompiledGrammar m, unsigned int keep) {
+	model = std::move(m);
+	growth = GrowthPredictor(model);
+	angle1 = model.info().angle1;
+	angle2 = model.info().angle2;
+	trunk_color = model.color(0);
+	branch_color = model.color(1);
+	twig_color = model.color(2);
+	leaf_color = model.color(3);
+	check_intersect = model.flag(CompiledGrammar::FLAG_CHECK_INTERSECT);
+	show_intersect_color = model.flag(CompiledGrammar::FLAG_SHOW_INTERSECT);
+
+	if (keep == 0)
+		strings.assign(1, std::string(model.axiom()));
+	else if (keep < strings.size())
+		strings.resize(keep);
+	if (!model.parametric()) {
+		modules.reset();
+		moduleStrings.clear();
+	}
+	else if (keep == 0 || !modules)
+		loadModules();
+	else if (keep < moduleStrings.size())
+		moduleStrings.resize(keep);
+	countStringBytes();
+}
+
+void Generator::truncateStrings(unsigned int keep) {
+	keep = std::max(keep, 1u);
+	if (keep < strings.size())
+		strings.resize(keep);
+	if (keep < moduleStrings.size())
+		moduleStrings.resize(keep);
+	countStringBytes();
+}
+
+void Generator::countStringBytes() {
+	size_t bytes = 0;
+	for (auto& str : strings)
+		bytes += str.capacity();
+	for (auto& str : moduleStrings)
+		bytes += str.capacity() * sizeof(uint32_t);
+	stringBytes = bytes;
+}
+
+size_t Generator::predictStringBytes(unsigned int iter) const {
+	double bytes = 0.0;
+	for (unsigned int k = getStringCount(); k <= iter; k++)
+		bytes += growth.predict(k).length * (modules ? sizeof(uint32_t) : 1);
+	return bytes < (double)(SIZE_MAX / 2) ? (size_t)bytes : SIZE_MAX / 2;
+}
+
+// String k is unchanged if the axiom is and no earlier string holds a
+// symbol whose rules changed
+unsigned int Generator::firstAffected(const ModelDiff& d) const {
+	if (d.axiom)
+		return 0;
+	if (!d.anyRule)
+		return std::numeric_limits<unsigned int>::max();
+	for (size_t k = 0; k < strings.size(); k++) {
+		for (char c : strings[k]) {
+			if (d.rules[(unsigned char)c])
+				return k + 1;
+		}
+	}
+	return strings.size();
+}
+
+// Point g at the vertices of a cache entry
+static void useCached(IterGeometry& g, std::shared_ptr<const CachedGeometry> hit) {
+	auto& h = hit->header();
+	g.trunk = h.trunk;
+	g.branch = h.branch;
+	g.twig = h.twig;
+	g.verts = static_cast<const LineData*>(hit->verts());
+	g.count = h.count;
+	g.cached = std::move(hit);
+}
+
+// Generate one iteration into an IterGeometry that owns (or maps) its vertices
+IterGeometry Generator::generate(unsigned int iter, JobControl* ctl) {
+	IterGeometry g;
+	g.iter = iter;
+	if (auto hit = findCached(iter)) {
+		useCached(g, std::move(hit));
+		return g;
+	}
+
+	// Temporaries are released in one step when the iteration ends
+	ArenaScope scope;
+	deriveStrings(iter, ctl);
+	g.owned = modules ? createGeometry(moduleStrings[iter], iter, g.trunk, g.branch, g.twig, ctl, std::pmr::get_default_resource()) :
+		createGeometry(strings[iter], iter, g.trunk, g.branch, g.twig, ctl, std::pmr::get_default_resource());
+	g.verts = g.owned.data();
+	g.count = g.owned.size();
+	if (cache)
+		cache->store(geometryKey(iter), g.verts, g.count, g.trunk, g.branch, g.twig);
+	return g;
+}
+
+IterGeometry Generator::generateOnly(unsigned int iter, JobControl* ctl) {
+	IterGeometry g;
+	g.iter = iter;
+	if (auto hit = findCached(iter)) {
+		useCached(g, std::move(hit));
+		return g;
+	}
+
+	ArenaScope scope;
+	if (modules) {
+		ModuleString string;
+		deriveOnly(iter, string, ctl);
+		g.owned = createGeometry(string, iter, g.trunk, g.branch, g.twig, ctl, std::pmr::get_default_resource());
+	}
+	else {
+		std::string string;
+		deriveOnly(iter, string, ctl);
+		g.owned = createGeometry(string, iter, g.trunk, g.branch, g.twig, ctl, std::pmr::get_default_resource());
+	}
+	g.verts = g.owned.data();
+	g.count = g.owned.size();
+	if (cache)
+		cache->store(geometryKey(iter), g.verts, g.count, g.trunk, g.branch, g.twig);
+	return g;
+}
+
+// Radius of the subtrees a coarse walk leaves out: a fixed share of the
+// largest subtree in the axiom
+static float coarseRadius(const CompiledGrammar& model, const SubtreeBounds& bounds, unsigned int iter) {
+	float radius = 0.f;
+	for (char c : model.axiom())
+		radius = std::max(radius, bounds.at(c, iter).radius);
+	return radius / COARSE_DIVISIONS;
+}
+
+// Radius below which subtrees are under threshold pixels, with the extent
+// of the coarse walk's segments filling VIEW_SPAN of the view
+static float detailRadius(const Turtle& coarse, float viewPixels, float threshold) {
+	LineBuffer verts(&Arena::local());
+	coarse.collect(verts);
+	glm::vec3 minBB, maxBB;
+	boundingBox(verts.data(), verts.size(), minBB, maxBB);
+	glm::vec3 diag = maxBB - minBB;
+	float extent = std::max(std::max(diag.x, diag.y), diag.z);
+	if (verts.empty() || extent <= 0.f)
+		return 0.f;
+	return threshold * extent / (viewPixels * Generator::VIEW_SPAN);
+}
+
+// Expands the derivation tree from the axiom, interpreting as it goes, and
+// stops at subtrees whose bounding sphere is too small to see
+IterGeometry Generator::generateAdaptive(unsigned int iter, float viewPixels, float threshold,
+	JobControl* ctl) {
+
+	if (!adaptive())
+		return generate(iter, ctl);
+	if (ctl) ctl->stage = JobControl::INTERPRETING;
+
+	SubtreeBounds bounds(model, iter, angle1, angle2);
+	IterGeometry g;
+	g.iter = iter;
+	ArenaScope scope;
+	auto expand = [&](Turtle& t, float minRadius) {
+		AdaptiveWalk walk(*this, bounds, iter, minRadius);
+		while (!walk.run(t, CHECK_INTERVAL)) {
+			if (ctl && ctl->cancelled)
+				throw GenerationCancelled();
+		}
+	};
+
+	// The view scales the model to fit, so its size comes first, from a
+	// coarse pass whose bounds are off by at most the subtrees it skips
+	float minRadius = 0.f;
+	if (threshold > 0.f && viewPixels > 0.f) {
+		Turtle coarse(&Arena::local(), makeRandom(seed, iter, 1), angle1, angle2);
+		expand(coarse, coarseRadius(model, bounds, iter));
+		minRadius = detailRadius(coarse, viewPixels, threshold);
+	}
+
+	Turtle turtle(&Arena::local(), makeRandom(seed, iter, 1), angle1, angle2);
+	expand(turtle, minRadius);
+
+	g.trunk = turtle.trunks.size();
+	g.branch = turtle.branches.size();
+	g.twig = turtle.twigs.size();
+	turtle.collect(g.owned);
+	g.verts = g.owned.data();
+	g.count = g.owned.size();
+	return g;
+}
+
+std::shared_ptr<const OrientationGroup> Generator::orientations() const {
+	if (check_intersect)
+		return nullptr;
+	return OrientationGroup::find(angle1, angle2);
+}
+
+bool Generator::usesSeed() const {
+	return check_intersect || (modules ? modules->stochastic() : model.stochastic());
+}
+
+bool Generator::adaptive() const {
+	return !check_intersect && SubtreeBounds::supports(model);
+}
+
+AdaptiveWalk::AdaptiveWalk(const Generator& gen, const SubtreeBounds& bounds, unsigned int iter, float minRadius) :
+	gen(gen),
+	bounds(bounds),
+	minRadius(minRadius),
+	stack({ Frame{ gen.model.axiom(), 0, iter } }) {
+}
+
+bool AdaptiveWalk::run(Turtle& t, size_t steps) {
+	const CompiledGrammar& model = gen.model;
+	for (; steps > 0 && !stack.empty(); steps--) {
+		Frame& f = stack.back();
+		if (f.pos == f.symbols.size()) {
+			stack.pop_back();
+			continue;
+		}
+		char c = f.symbols[f.pos++];
+		unsigned int depth = f.depth;
+		const RuleSlot& slot = model.slot(c);
+		if (depth == 0 || !slot.count) {
+			gen.interpret(c, t);
+			continue;
+		}
+
+		const SubtreeBounds::Entry& e = bounds.at(c, depth);
+		if (e.radius < minRadius) {
+			// Stand in for the subtree with one segment from its start to its end
+			glm::vec3 end = t.pos + t.rot * e.move;
+			if (e.category >= 0 && end != t.pos) {
+				LineBuffer* buffers[4] = { &t.trunks, &t.branches, &t.twigs, &t.leaves };
+				glm::vec3 colors[4] = { gen.trunk_color, gen.branch_color, gen.twig_color, gen.leaf_color };
+				buffers[e.category]->emplace_back(t.pos, colors[e.category]);
+				buffers[e.category]->emplace_back(end, colors[e.category]);
+			}
+			t.pos = end;
+			t.turnBy(glm::quat_cast(e.rot));
+			continue;
+		}
+		stack.push_back(Frame{ model.successor(model.alts()[slot.first]), 0, depth - 1 });
+	}
+	return stack.empty();
+}
+
+std::shared_ptr<const CachedGeometry> Generator::findCached(unsigned int iter) const {
+	return cache ? cache->find(geometryKey(iter)) : nullptr;
+}
+
+// Rewrite strings up to and including iteration iter
+// Each iteration has its own random sequence, so strings derived here
+// match the ones a full run would have produced
+void Generator::deriveStrings(unsigned int iter, JobControl* ctl) {
+	while (modules && moduleStrings.size() <= iter) {
+		ModuleString next;
+		applyRules(moduleStrings.back(), next, moduleStrings.size(), ctl);
+		stringBytes += next.capacity() * sizeof(uint32_t);
+		moduleStrings.push_back(std::move(next));
+	}
+	while (!modules && strings.size() <= iter) {
+		std::string newString;
+		applyRules(strings.back(), newString, strings.size(), ctl);
+		stringBytes += newString.capacity();
+		strings.push_back(std::move(newString));
+	}
+}
+
+// Stochastic models rewrite from the latest stored string, keeping only
+// the string being rewritten
+void Generator::deriveOnly(unsigned int iter, std::string& out, JobControl* ctl) const {
+	if (modules)
+		throw std::runtime_error("parametric models have no character strings");
+	if (iter < strings.size()) {
+		out = strings[iter];
+		return;
+	}
+	if (DirectDerivation::supports(model)) {
+		DirectDerivation(model, iter).derive(out, ctl);
+		return;
+	}
+	std::string prev = strings.back();
+	for (unsigned int k = strings.size(); k <= iter; k++) {
+		out.clear();
+		applyRules(prev, out, k, ctl);
+		if (k < iter)
+			prev.swap(out);
+	}
+}
+
+void Generator::deriveOnly(unsigned int iter, ModuleString& out, JobControl* ctl) const {
+	if (iter < moduleStrings.size()) {
+		out = moduleStrings[iter];
+		return;
+	}
+	ModuleString prev = moduleStrings.back();
+	for (unsigned int k = moduleStrings.size(); k <= iter; k++) {
+		out.clear();
+		applyRules(prev, out, k, ctl);
+		if (k < iter)
+			prev.swap(out);
+	}
+}
+
+// Everything the geometry of an iteration depends on
+GeometryKey Generator::geometryKey(unsigned int iter) const {
+	GeometryKey key;
+	std::memset(&key, 0, sizeof(key));		// Keys are hashed bytewise
+	key.modelHash = model.hash();
+	// Models that never draw a random number look the same for every seed,
+	// so their entries are shared across launches
+	key.seed = usesSeed() ? seed : 0;
+	key.iter = iter;
+	key.angle1 = angle1;
+	key.angle2 = angle2;
+	key.format = VERTEX_FORMAT;
+	key.vertSize = sizeof(LineData);
+	return key;
+}
+
+// Apply rules to a given string, appending the result to newstr
+void Generator::applyRules(std::string_view string, std::string& newstr, unsigned int iter,
+	JobControl* ctl) const {
+
+	if (ctl) ctl->stage = JobControl::REWRITING;
+	NeighbourIndex context;
+	if (model.contextual()) {
+		context = NeighbourIndex(string, ctl ? &ctl->cancelled : nullptr);
+		if (ctl && ctl->cancelled)
+			throw GenerationCancelled();
+	}
+	auto rewriteChunk = [&](size_t k, std::string& out) {
+		std::mt19937 gen = makeRandom(seed, iter, 0, k);
+		size_t end = std::min(string.size(), (k + 1) * REWRITE_CHUNK);
+		if (context.empty()) {
+			for (size_t i = k * REWRITE_CHUNK; i < end; i++)
+				rewrite(string[i], out, gen);
+		}
+		else {
+			for (size_t i = k * REWRITE_CHUNK; i < end; i++)
+				rewrite(string[i], context.left(i), context.right(i), out, gen);
+		}
+	};
+
+	size_t chunks = (string.size() + REWRITE_CHUNK - 1) / REWRITE_CHUNK;
+	if (chunks <= 1 || TaskScheduler::global().concurrency() == 1) {
+		GrowthEstimate e = growth.predict(iter);
+		newstr.reserve(newstr.size() + reserveSize(e.length, e.exact));
+		for (size_t k = 0; k < chunks; k++) {
+			if (ctl) checkJob(ctl, k * REWRITE_CHUNK, string.size());
+			rewriteChunk(k, newstr);
+		}
+		return;
+	}
+
+	// Rewrite chunks side by side, then join them in order
+	std::vector<std::string> parts(chunks);
+	std::atomic<size_t> done(0);
+	parallelFor(0, chunks, 1, [&](size_t k, size_t) {
+		size_t end = std::min(string.size(), (k + 1) * REWRITE_CHUNK);
+		parts[k].reserve((end - k * REWRITE_CHUNK) * 2);
+		rewriteChunk(k, parts[k]);
+		if (ctl) ctl->progress = (float)++done / (float)chunks;
+	}, ctl ? &ctl->cancelled : nullptr);
+	if (ctl && ctl->cancelled)
+		throw GenerationCancelled();
+
+	size_t total = newstr.size();
+	for (auto& part : parts)
+		total += part.size();
+	newstr.reserve(total);
+	for (auto& part : parts)
+		newstr += part;
+}
+
+// Chunks are REWRITE_CHUNK modules rather than characters; since modules
+// vary in length, a first pass finds where each chunk starts
+void Generator::applyRules(const ModuleString& string, ModuleString& out, unsigned int iter,
+	JobControl* ctl) const {
+
+	if (ctl) ctl->stage = JobControl::REWRITING;
+	std::vector<size_t> starts;
+	size_t n = 0;
+	for (size_t i = 0; i < string.size(); i += 1 + moduleParams(string[i]), n++) {
+		if (n % REWRITE_CHUNK == 0)
+			starts.push_back(i);
+	}
+	starts.push_back(string.size());
+	size_t chunks = starts.size() - 1;
+
+	auto rewriteChunk = [&](size_t k, ModuleString& dest) {
+		std::mt19937 gen = makeRandom(seed, iter, 0, k);
+		for (size_t i = starts[k]; i < starts[k + 1]; i += 1 + moduleParams(string[i]))
+			rewrite(&string[i], dest, gen);
+	};
+	if (chunks <= 1 || TaskScheduler::global().concurrency() == 1) {
+		GrowthEstimate e = growth.predict(iter);
+		out.reserve(out.size() + reserveSize(e.length, e.exact));
+		for (size_t k = 0; k < chunks; k++) {
+			if (ctl) checkJob(ctl, starts[k], string.size());
+			rewriteChunk(k, out);
+		}
+		return;
+	}
+
+	std::vector<ModuleString> parts(chunks);
+	std::atomic<size_t> done(0);
+	parallelFor(0, chunks, 1, [&](size_t k, size_t) {
+		parts[k].reserve((starts[k + 1] - starts[k]) * 2);
+		rewriteChunk(k, parts[k]);
+		if (ctl) ctl->progress = (float)++done / (float)chunks;
+	}, ctl ? &ctl->cancelled : nullptr);
+	if (ctl && ctl->cancelled)
+		throw GenerationCancelled();
+
+	size_t total = out.size();
+	for (auto& part : parts)
+		total += part.size();
+	out.reserve(total);
+	for (auto& part : parts)
+		out.insert(out.end(), part.begin(), part.end());
+}
+
+// Append the successor of one module, or the module itself when no rule
+// takes its number of parameters
+void Generator::rewrite(const uint32_t* module, ModuleString& out, std::mt19937& gen) const {
+	uint32_t count = moduleParams(*module);
+	const RuleSlot& slot = modules->slot(moduleSymbol(*module));
+	const ModuleAlt* alts = modules->alts();
+	if (slot.count && alts[slot.first].arity == count) {
+		float params[ParametricGrammar::MAX_PARAMS];
+		for (uint32_t k = 0; k < count; k++)
+			params[k] = moduleParam(module, k);
+		if (slot.count == 1) {
+			modules->expand(alts[slot.first], params, out);
+			return;
+		}
+		int random = getRandomNumber(gen, 1000);
+		for (uint32_t i = slot.first; i < slot.first + slot.count; i++) {
+			if (random <= alts[i].threshold) {
+				modules->expand(alts[i], params, out);
+				return;
+			}
+		}
+		return;
+	}
+	out.insert(out.end(), module, module + 1 + count);
+}
+
+// Append the successor of one symbol to newstr
+inline void Generator::rewrite(char c, std::string& newstr, std::mt19937& gen) const {
+	const RuleSlot& slot = model.slot(c);
+	if (slot.count == 1) {
+		newstr += model.successor(model.alts()[slot.first]);
+	}
+	else if (slot.count > 1) {
+		// Pick an alternative by its cumulative probability
+		const RuleAlt* alts = model.alts();
+		int random = getRandomNumber(gen, 1000);
+		for (uint32_t i = slot.first; i < slot.first + slot.count; i++) {
+			if (random <= alts[i].threshold) {
+				newstr += model.successor(alts[i]);
+				break;
+			}
+		}
+	}
+	else
+	{
+		newstr += c;
+	}
+}
+
+// The first group of alternatives whose context matches applies; without
+// one, the symbol is copied
+inline void Generator::rewrite(char c, char left, char right, std::string& newstr, std::mt19937& gen) const {
+	const RuleSlot& slot = model.slot(c);
+	const RuleAlt* alts = model.alts();
+	uint32_t end = slot.first + slot.count;
+	for (uint32_t first = slot.first; first < end; ) {
+		const RuleAlt& a = alts[first];
+		uint32_t last = first + 1;
+		while (last < end && alts[last].left == a.left && alts[last].right == a.right)
+			last++;
+		if ((a.left && a.left != left) || (a.right && a.right != right)) {
+			first = last;
+			continue;
+		}
+		if (last - first == 1) {
+			newstr += model.successor(a);
+			return;
+		}
+		int random = getRandomNumber(gen, 1000);
+		for (uint32_t i = first; i < last; i++) {
+			if (random <= alts[i].threshold) {
+				newstr += model.successor(alts[i]);
+				return;
+			}
+		}
+		return;
+	}
+	newstr += c;
+}
+
+glm::mat3 Generator::rotate(const float degree, const int axis) {
+	// degree: rotation degree
+	// axis: which axis to rotate around
+
+	glm::mat3 res = glm::mat3(1.0f);
+	// Task: implement the function for rotation.
+	// Step1: convert degree to radians (you can use "glm::radians").
+	// Step2: recall the 3 basic rotation matrices (around x, y and z) you learn in class.
+	// Step3: there should be 3 cases, conditioned on which axis to rotate around.
+	// Step4: fill in the rotation matrix "res" (above).
+
+	double rad = glm::radians(degree);
+	double sinvalue = sin(rad);
+	double cosvalue = cos(rad);
+
+	glm::vec3 row1 = glm::vec3(0.0f);
+	glm::vec3 row2 = glm::vec3(0.0f);
+	glm::vec3 row3 = glm::vec3(0.0f);
+
+	if (axis == 1) {
+		//X
+		row1 = glm::vec3(cosvalue, -sinvalue, 0);
+		row2 = glm::vec3(sinvalue, cosvalue, 0);
+		row3 = glm::vec3(0, 0, 1);
+	}
+	else if (axis == 2) {
+		//Y
+		row1 = glm::vec3(cosvalue, 0, -sinvalue);
+		row2 = glm::vec3(0, 1, 0);
+		row3 = glm::vec3(sinvalue, 0, cosvalue);
+	}
+	else if (axis == 3) {
+		//Z
+		row1 = glm::vec3(1, 0, 0);
+		row2 = glm::vec3(0, cosvalue, -sinvalue);
+		row3 = glm::vec3(0, sinvalue, cosvalue);
+		
+	}
+
+	res[0] = row1;
+	res[1] = row2;
+	res[2] = row3;
+
+	return res;
+}
+
+Turtle::Turtle(std::pmr::memory_resource* mem, std::mt19937 random, float angle1, float angle2,
+	std::shared_ptr<const OrientationGroup> group) :
+	pos(0, 1, 0),
+	rot(1.f, 0.f, 0.f, 0.f),
+	turns{ glm::quat_cast(Generator::rotate(angle1, 1)), glm::quat_cast(Generator::rotate(-angle1, 1)),
+		glm::quat_cast(Generator::rotate(angle2, 2)), glm::quat_cast(Generator::rotate(-angle2, 2)) },
+	unnormalized(0),
+	group(std::move(group)),
+	orient(0),
+	stack(mem),
+	indexStack(mem),
+	trunks(mem),
+	branches(mem),
+	twigs(mem),
+	leaves(mem),
+	random(random) {}
+
+// Make room for the predicted segments and stack depth of a string
+void Turtle::reserve(const GrowthEstimate& e) {
+	reserveStack(e.depth);
+	LineBuffer* buffers[4] = { &trunks, &branches, &twigs, &leaves };
+	for (int k = 0; k < 4; k++)
+		buffers[k]->reserve(reserveSize(2 * e.segments[k], e.exact));
+}
+
+void Turtle::reserveStack(size_t depth) {
+	if (group) indexStack.reserve(depth);
+	else stack.reserve(depth);
+}
+
+// Order segments by category: trunks, branches, twigs, then leaves
+void Turtle::collect(LineBuffer& out) const {
+	out.reserve(out.size() + trunks.size() + branches.size() + twigs.size() + leaves.size());
+	out.insert(out.end(), trunks.begin(), trunks.end());
+	out.insert(out.end(), branches.begin(), branches.end());
+	out.insert(out.end(), twigs.begin(), twigs.end());
+	out.insert(out.end(), leaves.begin(), leaves.end());
+}
+
+// Generate the geometry corresponding to the string at the given iteration
+LineBuffer Generator::createGeometry(std::string_view string, unsigned int iter,
+	int& trunk, int& branch, int& twig, JobControl* ctl, std::pmr::memory_resource* out) const {
+
+	// All temporaries come from the per-thread arena
+	Arena& arena = Arena::local();
+	LineBuffer result(out ? out : &arena);
+	if (ctl) ctl->stage = JobControl::INTERPRETING;
+
+	// Each segment avoids all earlier ones, so intersection checks must
+	// interpret in order; otherwise the string is split into chunks
+	size_t chunks = (string.size() + INTERPRET_CHUNK - 1) / INTERPRET_CHUNK;
+	GrowthEstimate e = growth.predict(iter);
+	if (check_intersect || chunks <= 1 || TaskScheduler::global().concurrency() == 1) {
+		Turtle turtle(&arena, makeRandom(seed, iter, 1), angle1, angle2, orientations());
+		turtle.reserve(e);
+		size_t n = 0;
+		for (char c : string) {
+			if (ctl && ++n % CHECK_INTERVAL == 0)
+				checkJob(ctl, n, string.size());
+			interpret(c, turtle);
+		}
+		trunk = turtle.trunks.size();
+		branch = turtle.branches.size();
+		twig = turtle.twigs.size();
+		turtle.collect(result);
+		return result;
+	}
+
+	// Walk the whole string once without drawing, to find the turtle
+	// state where each chunk starts
+	std::vector<Turtle> turtles;
+	turtles.reserve(chunks);
+	Turtle walker(std::pmr::get_default_resource(), makeRandom(seed, iter, 1), angle1, angle2, orientations());
+	walker.reserveStack(e.depth);
+	for (size_t k = 0; k < chunks; k++) {
+		if (ctl) checkJob(ctl, k * INTERPRET_CHUNK, string.size() * 2);
+		turtles.push_back(walker);
+		size_t end = std::min(string.size(), (k + 1) * INTERPRET_CHUNK);
+		for (size_t i = k * INTERPRET_CHUNK; i < end; i++)
+			walk(string[i], walker);
+	}
+
+	// Draw the chunks side by side from their start states
+	std::atomic<size_t> done(0);
+	parallelFor(0, chunks, 1, [&](size_t k, size_t) {
+		size_t end = std::min(string.size(), (k + 1) * INTERPRET_CHUNK);
+		for (size_t i = k * INTERPRET_CHUNK; i < end; i++)
+			interpret(string[i], turtles[k]);
+		if (ctl) ctl->progress = 0.5f + 0.5f * (float)++done / (float)chunks;
+	}, ctl ? &ctl->cancelled : nullptr);
+	if (ctl && ctl->cancelled)
+		throw GenerationCancelled();
+
+	// Join the chunks, keeping each category together and in order
+	trunk = branch = twig = 0;
+	size_t total = 0;
+	for (auto& t : turtles) {
+		trunk += t.trunks.size();
+		branch += t.branches.size();
+		twig += t.twigs.size();
+		total += t.trunks.size() + t.branches.size() + t.twigs.size() + t.leaves.size();
+	}
+	result.reserve(total);
+	for (LineBuffer Turtle::* category : { &Turtle::trunks, &Turtle::branches, &Turtle::twigs, &Turtle::leaves })
+		for (auto& t : turtles)
+			result.insert(result.end(), (t.*category).begin(), (t.*category).end());
+	return result;
+}
+
+// Interpret a module string in order
+LineBuffer Generator::createGeometry(const ModuleString& string, unsigned int iter,
+	int& trunk, int& branch, int& twig, JobControl* ctl, std::pmr::memory_resource* out) const {
+
+	Arena& arena = Arena::local();
+	LineBuffer result(out ? out : &arena);
+	if (ctl) ctl->stage = JobControl::INTERPRETING;
+	Turtle turtle(&arena, makeRandom(seed, iter, 1), angle1, angle2);
+	turtle.reserve(growth.predict(iter));
+	size_t n = 0;
+	for (size_t i = 0; i < string.size(); i += 1 + moduleParams(string[i])) {
+		if (ctl && ++n % CHECK_INTERVAL == 0)
+			checkJob(ctl, i, string.size());
+		interpret(&string[i], turtle);
+	}
+	trunk = turtle.trunks.size();
+	branch = turtle.branches.size();
+	twig = turtle.twigs.size();
+	turtle.collect(result);
+	return result;
+}
+
+// Index of the first segment at or after from (an even vertex index) that
+// crosses p0-p1, or segs.size() if there is none
+// Runs once per drawn segment, too often to be worth forking tasks for
+static size_t findIntersection(const LineBuffer& segs, size_t from, const glm::vec3& p0, const glm::vec3& p1) {
+	for (size_t i = from; i + 1 < segs.size(); i += 2) {
+		if (doLineSegmentsIntersect(p0, p1, segs[i].pos, segs[i + 1].pos))
+			return i;
+	}
+	return segs.size();
+}
+
+// Move the turtle for one symbol without drawing
+// Must change pos and rot exactly as interpret() does
+inline void Generator::walk(char c, Turtle& t) const {
+	switch (c) {
+		case '+': t.turn(0); break;
+		case '-': t.turn(1); break;
+		case '*': t.turn(2); break;
+		case '^': t.turn(3); break;
+		case '[': t.push(); break;
+		case ']': t.pop(); break;
+		case 'N':
+		case 'n':
+		case 'p':
+		case 'o':
+		case 'i':
+		case 's':
+		case 'S':
+			break;
+		default:
+			t.pos += t.heading();
+	}
+}
+
+// Move the turtle for one symbol, adding any segment it draws
+inline void Generator::interpret(char c, Turtle& t) const {
+	switch (c) {
+		case '+':
+		case '-':
+		case '*':
+		case '^':
+		case '[':
+		case ']':
+		case 'N':
+		case 'n':
+		case 'p':
+		case 'o':
+		case 'i':
+		case 's':
+		case 'S':
+			walk(c, t);
+			break;
+		default: {
+			if (check_intersect) {
+				drawClear(c, t);
+				break;
+			}
+			int k = symbolCategory(c);
+			LineBuffer& segs = t.segments(k);
+			const glm::vec3& color = k == 0 ? trunk_color : k == 1 ? branch_color : k == 2 ? twig_color : leaf_color;
+			segs.emplace_back(t.pos, color);
+			t.pos += t.heading();
+			segs.emplace_back(t.pos, color);
+			break; }
+	}
+}
+
+// Draw the segment for c, nudging it randomly until it clears every
+// earlier one; nudged segments are coloured red if the model asks
+void Generator::drawClear(char c, Turtle& t) const {
+	glm::vec3 temp_color = leaf_color;
+	if (c == 'G' || c == 'W' || c == 'w') {
+		t.trunks.emplace_back(t.pos, trunk_color);
+		temp_color = trunk_color;
+	}
+	else if (c == 'F' || c == 'f') {
+		t.branches.emplace_back(t.pos, branch_color);
+		temp_color = branch_color;
+	}
+	else if (c == 'T' || c == 'Z' || c == 't' || c == 'z') {
+		t.twigs.emplace_back(t.pos, twig_color);
+		temp_color = twig_color;
+	}
+	else {
+		t.leaves.emplace_back(t.pos, leaf_color);
+	}
+	glm::vec3 prev_loc = t.pos;
+	t.pos += t.heading();
+	for (const LineBuffer* segs : { &t.leaves, &t.trunks, &t.branches, &t.twigs }) {
+		for (size_t i = findIntersection(*segs, 0, prev_loc, t.pos); i + 1 < segs->size();
+			i = findIntersection(*segs, i + 2, prev_loc, t.pos)) {
+			while (doLineSegmentsIntersect(prev_loc, t.pos, (*segs)[i].pos, (*segs)[i + 1].pos)) {
+				t.pos = prev_loc + (glm::mat3_cast(t.rot) * glm::mat3(glm::rotate(getRandomNumber(t.random, 20) / (float)10, glm::vec3(1.f, 0.f, 0.f)))
+					* glm::mat3(glm::rotate(getRandomNumber(t.random, 20) / (float)10, glm::vec3(0.f, 1.f, 0.f)))
+					* glm::mat3(glm::rotate(getRandomNumber(t.random, 20) / (float)10, glm::vec3(0.f, 0.f, 1.f))) * glm::vec3(0.f, 1.f, 0.f));
+				if (show_intersect_color)
+					temp_color = glm::vec3(1, 0, 0);
+			}
+		}
+	}
+	if (c == 'G' || c == 'W' || c == 'w') {
+		t.trunks.emplace_back(t.pos, temp_color);
+	}
+	else if (c == 'F' || c == 'f') {
+		t.branches.emplace_back(t.pos, temp_color);
+	}
+	else if (c == 'T' || c == 'Z' || c == 't' || c == 'z') {
+		t.twigs.emplace_back(t.pos, twig_color);
+	}
+	else {
+		t.leaves.emplace_back(t.pos, temp_color);
+	}
+}
+
+// Move the turtle for one module. Without parameters it acts as its
+// character; the first parameter of a turn is its angle in degrees and
+// that of a drawing symbol its length. Parametric segments are not
+// nudged clear of others. Named modules only steer rewriting.
+inline void Generator::interpret(const uint32_t* module, Turtle& t) const {
+	uint32_t symbol = moduleSymbol(*module);
+	if (symbol >= 256)
+		return;
+	char c = (char)symbol;
+	if (moduleParams(*module) == 0) {
+		interpret(c, t);
+		return;
+	}
+
+	float value = moduleParam(module, 0);
+	switch (c) {
+	case '+': t.turnBy(glm::quat_cast(rotate(value, 1))); return;
+	case '-': t.turnBy(glm::quat_cast(rotate(-value, 1))); return;
+	case '*': t.turnBy(glm::quat_cast(rotate(value, 2))); return;
+	case '^': t.turnBy(glm::quat_cast(rotate(-value, 2))); return;
+	}
+	int k = symbolCategory(c);
+	if (k < 0) {
+		walk(c, t);
+		return;
+	}
+	glm::vec3 colors[4] = { trunk_color, branch_color, twig_color, leaf_color };
+	t.segments(k).emplace_back(t.pos, colors[k]);
+	t.pos += t.heading() * value;
+	t.segments(k).emplace_back(t.pos, colors[k]);
+}
+
+// Bounds of a vertex list, reduced in parallel for large lists
+void boundingBox(const LineData* verts, size_t count, glm::vec3& minBB, glm::vec3& maxBB) {
+	static const size_t CHUNK = 1 << 16;
+	size_t chunks = (count + CHUNK - 1) / CHUNK;
+	std::vector<glm::vec3> mins(chunks, glm::vec3(std::numeric_limits<float>::max()));
+	std::vector<glm::vec3> maxs(chunks, glm::vec3(std::numeric_limits<float>::lowest()));
+	parallelFor(0, chunks, 1, [&](size_t k, size_t) {
+		size_t end = std::min(count, (k + 1) * CHUNK);
+		for (size_t i = k * CHUNK; i < end; i++) {
+			mins[k] = glm::min(mins[k], verts[i].pos);
+			maxs[k] = glm::max(maxs[k], verts[i].pos);
+		}
+	});
+	minBB = glm::vec3(std::numeric_limits<float>::max());
+	maxBB = glm::vec3(std::numeric_limits<float>::lowest());
+	for (size_t k = 0; k < chunks; k++) {
+		minBB = glm::min(minBB, mins[k]);
+		maxBB = glm::max(maxBB, maxs[k]);
+	}
+}
+
+// Symbols between clock checks in a GenerationTask
+static const size_t SLICE_CHECK = 1 << 12;
+
+GenerationTask::GenerationTask(std::shared_ptr<Generator> gen, unsigned int iter, JobControl* ctl) :
+	gen(std::move(gen)),
+	ctl(ctl),
+	stage(LOOKUP),
+	pos(0),
+	modulesDone(0),
+	adapt(false),
+	viewPixels(0.f),
+	threshold(0.f) {
+
+	result.iter = iter;
+}
+
+GenerationTask::GenerationTask(std::shared_ptr<Generator> gen, unsigned int iter, float viewPixels, float threshold,
+	JobControl* ctl) :
+	GenerationTask(std::move(gen), iter, ctl) {
+
+	adapt = true;
+	this->viewPixels = viewPixels;
+	this->threshold = threshold;
+}
+
+GenerationTask::~GenerationTask() {}
+
+bool GenerationTask::step(std::chrono::steady_clock::time_point deadline) {
+	while (stage != DONE) {
+		if (ctl && ctl->cancelled)
+			throw GenerationCancelled();
+		if (std::chrono::steady_clock::now() >= deadline)
+			return false;
+
+		switch (stage) {
+		case LOOKUP:
+			if (adapt && gen->adaptive()) {
+				// Bounds are per symbol and depth, quick to work out in one go
+				bounds.reset(new SubtreeBounds(gen->model, result.iter, gen->angle1, gen->angle2));
+				bool measure = threshold > 0.f && viewPixels > 0.f;
+				turtle.reset(new Turtle(std::pmr::get_default_resource(), makeRandom(gen->seed, result.iter, 1),
+					gen->angle1, gen->angle2));
+				walk.reset(new AdaptiveWalk(*gen, *bounds, result.iter,
+					measure ? coarseRadius(gen->model, *bounds, result.iter) : 0.f));
+				stage = measure ? MEASURING : INTERPRETING;
+			}
+			else if (auto hit = gen->findCached(result.iter)) {
+				useCached(result, std::move(hit));
+				stage = DONE;
+			}
+			else {
+				stage = REWRITING;
+			}
+			break;
+		case MEASURING:
+			if (!walkSlice(deadline))
+				return false;
+			break;
+		case REWRITING:
+			if (!(gen->modules ? rewriteModuleSlice(deadline) : rewriteSlice(deadline)))
+				return false;
+			break;
+		case INTERPRETING:
+			if (walk) {
+				if (!walkSlice(deadline))
+					return false;
+			}
+			else if (!(gen->modules ? interpretModuleSlice(deadline) : interpretSlice(deadline)))
+				return false;
+			break;
+		case DONE:
+			break;
+		}
+	}
+	return true;
+}
+
+// Derive strings up to the target iteration, one input string at a time
+bool GenerationTask::rewriteSlice(std::chrono::steady_clock::time_point deadline) {
+	auto& strings = gen->strings;
+	if (strings.size() > result.iter) {
+		startInterpreting();
+		return true;
+	}
+
+	unsigned int iter = strings.size();
+	if (pos == 0) {
+		GrowthEstimate e = gen->growth.predict(iter);
+		next.clear();
+		next.reserve(reserveSize(e.length, e.exact));
+	}
+	if (ctl) ctl->stage = JobControl::REWRITING;
+
+	std::string_view string = strings.back();
+	if (pos == 0 && gen->model.contextual())
+		context = NeighbourIndex(string);
+	while (pos < string.size()) {
+		// Same random sequence per chunk as Generator::applyRules()
+		if (pos % REWRITE_CHUNK == 0)
+			random = makeRandom(gen->seed, iter, 0, pos / REWRITE_CHUNK);
+		size_t end = std::min(string.size(), pos + SLICE_CHECK);
+		if (context.empty()) {
+			for (; pos < end; pos++)
+				gen->rewrite(string[pos], next, random);
+		}
+		else {
+			for (; pos < end; pos++)
+				gen->rewrite(string[pos], context.left(pos), context.right(pos), next, random);
+		}
+		if (ctl) ctl->progress = (float)pos / (float)string.size();
+		if (pos < string.size() && std::chrono::steady_clock::now() >= deadline)
+			return false;
+	}
+
+	gen->stringBytes += next.capacity();
+	strings.push_back(std::move(next));
+	next = std::string();
+	context = NeighbourIndex();
+	pos = 0;
+	return true;
+}
+
+// Walk the turtle over the target string, then collect its segments
+bool GenerationTask::interpretSlice(std::chrono::steady_clock::time_point deadline) {
+	std::string_view string = gen->strings[result.iter];
+	if (ctl) ctl->stage = JobControl::INTERPRETING;
+
+	while (pos < string.size()) {
+		size_t end = std::min(string.size(), pos + SLICE_CHECK);
+		for (; pos < end; pos++)
+			gen->interpret(string[pos], *turtle);
+		if (ctl) ctl->progress = (float)pos / (float)string.size();
+		if (pos < string.size() && std::chrono::steady_clock::now() >= deadline)
+			return false;
+	}
+	finish();
+	return true;
+}
+
+// Module strings are rewritten in the same chunks of REWRITE_CHUNK modules
+// as Generator::applyRules(), so they draw the same random numbers
+bool GenerationTask::rewriteModuleSlice(std::chrono::steady_clock::time_point deadline) {
+	auto& strings = gen->moduleStrings;
+	if (strings.size() > result.iter) {
+		startInterpreting();
+		return true;
+	}
+
+	unsigned int iter = strings.size();
+	if (pos == 0) {
+		GrowthEstimate e = gen->growth.predict(iter);
+		nextModules.clear();
+		nextModules.reserve(reserveSize(e.length, e.exact));
+	}
+	if (ctl) ctl->stage = JobControl::REWRITING;
+
+	const ModuleString& string = strings.back();
+	while (pos < string.size()) {
+		size_t end = std::min(string.size(), pos + SLICE_CHECK);
+		for (; pos < end; pos += 1 + moduleParams(string[pos]), modulesDone++) {
+			if (modulesDone % REWRITE_CHUNK == 0)
+				random = makeRandom(gen->seed, iter, 0, modulesDone / REWRITE_CHUNK);
+			gen->rewrite(&string[pos], nextModules, random);
+		}
+		if (ctl) ctl->progress = (float)pos / (float)string.size();
+		if (pos < string.size() && std::chrono::steady_clock::now() >= deadline)
+			return false;
+	}
+
+	gen->stringBytes += nextModules.capacity() * sizeof(uint32_t);
+	strings.push_back(std::move(nextModules));
+	nextModules = ModuleString();
+	pos = 0;
+	modulesDone = 0;
+	return true;
+}
+
+bool GenerationTask::interpretModuleSlice(std::chrono::steady_clock::time_point deadline) {
+	const ModuleString& string = gen->moduleStrings[result.iter];
+	if (ctl) ctl->stage = JobControl::INTERPRETING;
+
+	while (pos < string.size()) {
+		size_t end = std::min(string.size(), pos + SLICE_CHECK);
+		for (; pos < end; pos += 1 + moduleParams(string[pos]))
+			gen->interpret(&string[pos], *turtle);
+		if (ctl) ctl->progress = (float)pos / (float)string.size();
+		if (pos < string.size() && std::chrono::steady_clock::now() >= deadline)
+			return false;
+	}
+	finish();
+	return true;
+}
+
+// The coarse walk sizes the view; the walk after it is the one kept
+bool GenerationTask::walkSlice(std::chrono::steady_clock::time_point deadline) {
+	if (ctl) ctl->stage = JobControl::INTERPRETING;
+	while (!walk->run(*turtle, SLICE_CHECK)) {
+		if (std::chrono::steady_clock::now() >= deadline)
+			return false;
+	}
+	if (stage == INTERPRETING) {
+		finish();
+		return true;
+	}
+
+	float minRadius;
+	{
+		ArenaScope scope;
+		minRadius = detailRadius(*turtle, viewPixels, threshold);
+	}
+	turtle.reset(new Turtle(std::pmr::get_default_resource(), makeRandom(gen->seed, result.iter, 1),
+		gen->angle1, gen->angle2));
+	walk.reset(new AdaptiveWalk(*gen, *bounds, result.iter, minRadius));
+	stage = INTERPRETING;
+	return true;
+}
+
+// Parametric turns are not in the orientation table, so their turtle
+// rotates as Generator::createGeometry() does for module strings
+void GenerationTask::startInterpreting() {
+	stage = INTERPRETING;
+	turtle.reset(new Turtle(std::pmr::get_default_resource(), makeRandom(gen->seed, result.iter, 1),
+		gen->angle1, gen->angle2, gen->modules ? nullptr : gen->orientations()));
+	turtle->reserve(gen->growth.predict(result.iter));
+}
+
+void GenerationTask::finish() {
+	result.trunk = turtle->trunks.size();
+	result.branch = turtle->branches.size();
+	result.twig = turtle->twigs.size();
+	turtle->collect(result.owned);
+	result.verts = result.owned.data();
+	result.count = result.owned.size();
+	turtle.reset();
+	// Adaptive results depend on the view, so they are not cached
+	if (gen->cache && !walk)
+		gen->cache->store(gen->geometryKey(result.iter), result.verts, result.count,
+			result.trunk, result.branch, result.twig);
+	stage = DONE;
+}
@@ -0,0 +1,352 @@
+#ifndef GENERATOR_HPP
+#define GENERATOR_HPP
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include "compiled_grammar.hpp"
+#include "context.hpp"
+#include "geometry_cache.hpp"
+#include "growth.hpp"
+#include "orientation.hpp"
+#include "parametric.hpp"
+
+class SubtreeBounds;
+
+struct LineData {
+	glm::vec3 pos;
+	glm::vec3 color;
+
+	LineData(glm::vec3 pos_, glm::vec3 color_) : pos(pos_), color(color_) {}
+};
+
+// Vertex list allocated from a memory resource (usually an Arena)
+typedef std::pmr::vector<LineData> LineBuffer;
+
+// Finished geometry for one iteration, grouped trunk, branch, twig, leaf
+// Vertices either belong to the object or are viewed in a cache entry
+struct IterGeometry {
+	unsigned int iter = 0;
+	int trunk = 0;				// Vertices per category
+	int branch = 0;
+	int twig = 0;
+	const LineData* verts = nullptr;
+	size_t count = 0;
+	LineBuffer owned;			// Default resource, so it outlives any ArenaScope
+	std::shared_ptr<const CachedGeometry> cached;
+};
+
+// Progress and cancellation shared between a job and whoever started it
+struct JobControl {
+	enum Stage { REWRITING, INTERPRETING };
+
+	std::atomic<bool> cancelled{ false };
+	std::atomic<int> stage{ REWRITING };	// Step currently running
+	std::atomic<float> progress{ 0.0f };	// Fraction of the current step done
+};
+
+// Thrown out of generation when its JobControl is cancelled
+struct GenerationCancelled : std::runtime_error {
+	GenerationCancelled() : std::runtime_error("generation cancelled") {}
+};
+
+// Bounds of a vertex list
+void boundingBox(const LineData* verts, size_t count, glm::vec3& minBB, glm::vec3& maxBB);
+
+// Turtle state while interpreting a string, kept in one place so that
+// interpretation can stop after any symbol and carry on later
+// Orientation is a unit quaternion, or with an orientation group an index
+// into it. Each '[' saves position and orientation together as one frame
+// on a single stack, reserved for the predicted bracket depth.
+struct Turtle {
+	static const unsigned int RENORMALIZE = 32;	// Turns between renormalising rot
+
+	// State saved by '['
+	struct Frame {
+		glm::vec3 pos;
+		glm::quat rot;
+	};
+	struct IndexFrame {
+		glm::vec3 pos;
+		OrientationGroup::Index orient;
+	};
+
+	Turtle(std::pmr::memory_resource* mem, std::mt19937 random, float angle1, float angle2,
+		std::shared_ptr<const OrientationGroup> group = nullptr);
+
+	// Make room for a string of the predicted size
+	void reserve(const GrowthEstimate& e);
+	void reserveStack(size_t depth);
+	// Append all segments to out, grouped trunk, branch, twig, leaf
+	void collect(LineBuffer& out) const;
+	// Segments of category k (see symbolCategory())
+	LineBuffer& segments(int k) {
+		return k == 0 ? trunks : k == 1 ? branches : k == 2 ? twigs : leaves; }
+
+	// Apply turn k ('+', '-', '*', '^')
+	void turn(int k) {
+		if (group) orient = group->turn(orient, k);
+		else turnBy(turns[k]);
+	}
+	// Apply any rotation (not with a group)
+	void turnBy(const glm::quat& q) {
+		rot *= q;
+		if (++unnormalized == RENORMALIZE) {
+			rot = glm::normalize(rot);
+			unnormalized = 0;
+		}
+	}
+	// Direction of a unit step: rot applied to (0, 1, 0)
+	glm::vec3 heading() const {
+		if (group) return group->heading(orient);
+		return glm::vec3(2.f * (rot.x * rot.y - rot.w * rot.z),
+			1.f - 2.f * (rot.x * rot.x + rot.z * rot.z),
+			2.f * (rot.y * rot.z + rot.w * rot.x));
+	}
+	void push() {
+		if (group) indexStack.push_back(IndexFrame{ pos, orient });
+		else stack.push_back(Frame{ pos, rot });
+	}
+	void pop() {
+		if (group) {
+			pos = indexStack.back().pos;
+			orient = indexStack.back().orient;
+			indexStack.pop_back();
+		}
+		else {
+			pos = stack.back().pos;
+			rot = stack.back().rot;
+			stack.pop_back();
+		}
+	}
+
+	glm::vec3 pos;
+	glm::quat rot;
+	glm::quat turns[4];					// Rotations for '+', '-', '*' and '^'
+	unsigned int unnormalized;			// Turns since rot was renormalised
+	std::shared_ptr<const OrientationGroup> group;	// Null unless orientations are tabulated
+	OrientationGroup::Index orient;
+	std::pmr::vector<Frame> stack;		// Saved by '[', restored by ']'
+	std::pmr::vector<IndexFrame> indexStack;	// The same with a group
+	LineBuffer trunks;					// Segments by category
+	LineBuffer branches;
+	LineBuffer twigs;
+	LineBuffer leaves;
+	std::mt19937 random;				// Intersection avoidance
+};
+
+// CPU side of an L-System: rewriting and turtle interpretation
+// Makes no OpenGL calls, so it can run on any thread. A Generator is not
+// itself thread-safe; only one thread may use it at a time.
+class Generator {
+public:
+	static const size_t MAX_BUF = 1 << 26;		// Maximum vertex bytes of one iteration
+	static const uint32_t VERTEX_FORMAT = 4;	// Bump when LineData or generated results change
+	static constexpr float VIEW_SPAN = 1.9f;	// Size of a model's largest extent in the view
+
+	explicit Generator(CompiledGrammar model);
+
+	// Generate one iteration, using the cache when possible
+	IterGeometry generate(unsigned int iter, JobControl* ctl = nullptr);
+	// Cached geometry for an iteration, or null
+	std::shared_ptr<const CachedGeometry> findCached(unsigned int iter) const;
+
+	// Generate one iteration without keeping its string or earlier ones,
+	// for jobs that only need the final iteration
+	IterGeometry generateOnly(unsigned int iter, JobControl* ctl = nullptr);
+
+	// Generate one iteration for a view viewPixels from centre to edge,
+	// with the model scaled to VIEW_SPAN, drawing subtrees smaller than
+	// threshold pixels as one proxy segment each instead of expanding them.
+	// Not cached. Models the bounds cannot describe (see SubtreeBounds) are
+	// generated in full.
+	IterGeometry generateAdaptive(unsigned int iter, float viewPixels, float threshold,
+		JobControl* ctl = nullptr);
+	// Can generateAdaptive() leave detail out of this model?
+	bool adaptive() const;
+	// Does the seed change this model's geometry?
+	bool usesSeed() const;
+
+	// Rewrite strings (module strings for parametric models) up to and
+	// including iteration iter
+	void deriveStrings(unsigned int iter, JobControl* ctl = nullptr);
+	// Derive iteration iter into out without storing any strings
+	// Deterministic models are expanded straight from the axiom
+	void deriveOnly(unsigned int iter, std::string& out, JobControl* ctl = nullptr) const;
+	void deriveOnly(unsigned int iter, ModuleString& out, JobControl* ctl = nullptr) const;
+	std::string_view getString(unsigned int iter) {
+		deriveStrings(iter);
+		return strings.at(iter); }
+	// Parametric models only
+	const ModuleString& getModules(unsigned int iter) {
+		deriveStrings(iter);
+		return moduleStrings.at(iter); }
+	const ParametricGrammar* getParametric() const { return modules.get(); }
+	// Memory held by derived strings; safe to read from any thread
+	size_t getStringBytes() const { return stringBytes; }
+	// Iterations with a derived string, counting the axiom
+	unsigned int getStringCount() const {
+		return modules ? moduleStrings.size() : strings.size(); }
+	// Drop derived strings from iteration keep on (the axiom always stays);
+	// they are derived again when next needed
+	void truncateStrings(unsigned int keep);
+
+	// Apply rules to a given string, appending the result (iteration iter) to out
+	void applyRules(std::string_view string, std::string& out, unsigned int iter,
+		JobControl* ctl = nullptr) const;
+	void applyRules(const ModuleString& string, ModuleString& out, unsigned int iter,
+		JobControl* ctl = nullptr) const;
+	// Create geometry for a given string and return the vertices and category counts
+	// Result lives in out, by default Arena::local(), where it must not
+	// outlive the caller's ArenaScope
+	LineBuffer createGeometry(std::string_view string, unsigned int iter,
+		int& trunk, int& branch, int& twig, JobControl* ctl = nullptr,
+		std::pmr::memory_resource* out = nullptr) const;
+	LineBuffer createGeometry(const ModuleString& string, unsigned int iter,
+		int& trunk, int& branch, int& twig, JobControl* ctl = nullptr,
+		std::pmr::memory_resource* out = nullptr) const;
+
+	// Switch to an edited version of the model, keeping the first keep
+	// derived strings; angles are reset to the model's
+	void setModel(CompiledGrammar m, unsigned int keep);
+	// First iteration whose string is changed by an edit (see CompiledGrammar::diff)
+	unsigned int firstAffected(const ModelDiff& d) const;
+	// Size of an iteration, worked out from the rules without deriving it
+	GrowthEstimate predict(unsigned int iter) const { return growth.predict(iter); }
+	// Vertex bytes an iteration is expected to need, capped so that adding
+	// the bytes already in use cannot overflow
+	size_t predictBytes(unsigned int iter) const {
+		double bytes = growth.predict(iter).vertices() * sizeof(LineData);
+		return bytes < (double)(SIZE_MAX / 2) ? (size_t)bytes : SIZE_MAX / 2; }
+	// String bytes that deriving up to iteration iter is expected to add,
+	// capped as predictBytes() is
+	size_t predictStringBytes(unsigned int iter) const;
+
+	GeometryKey geometryKey(unsigned int iter) const;
+	const CompiledGrammar& getModel() const { return model; }
+	static glm::mat3 rotate(const float, const int);
+
+	float angle1;						// Angle for rotations
+	float angle2;
+	unsigned int seed;					// Seed for stochastic rules and intersection avoidance
+	GeometryCache* cache;				// Persistent geometry cache, may be null
+
+private:
+	friend class GenerationTask;
+	friend class AdaptiveWalk;
+
+	// Single symbol steps shared by whole-string and incremental generation
+	void rewrite(char c, std::string& out, std::mt19937& random) const;
+	// Context-sensitive models pass the symbol's neighbours
+	void rewrite(char c, char left, char right, std::string& out, std::mt19937& random) const;
+	void rewrite(const uint32_t* module, ModuleString& out, std::mt19937& random) const;
+	void interpret(char c, Turtle& turtle) const;
+	void drawClear(char c, Turtle& turtle) const;	// Draw avoiding intersections
+	void interpret(const uint32_t* module, Turtle& turtle) const;
+	void walk(char c, Turtle& turtle) const;	// Move without drawing
+	// Orientation table for the current angles, or null when the turns
+	// generate too many orientations or segments may be nudged off them
+	std::shared_ptr<const OrientationGroup> orientations() const;
+	void loadModules();					// Compile a parametric model and restart its strings
+	void countStringBytes();			// Recompute stringBytes from the strings held
+
+	CompiledGrammar model;				// Generation rules and settings
+	GrowthPredictor growth;				// Sizes of iterations, for reserving buffers
+	std::vector<std::string> strings;	// String representation of each derived iteration
+	std::shared_ptr<const ParametricGrammar> modules;	// Parametric models only
+	std::vector<ModuleString> moduleStrings;	// Module strings of each derived iteration
+	std::atomic<size_t> stringBytes;	// Total capacity of strings
+	glm::vec3 trunk_color;
+	glm::vec3 branch_color;
+	glm::vec3 twig_color;
+	glm::vec3 leaf_color;
+
+	bool check_intersect;
+	bool show_intersect_color;
+};
+
+// Expansion of the derivation tree for Generator::generateAdaptive(),
+// held as an explicit stack so it can stop after any number of symbols
+// and go on later. Subtrees whose bounding sphere is smaller than
+// minRadius are drawn as one proxy segment from their start to their end.
+class AdaptiveWalk {
+public:
+	AdaptiveWalk(const Generator& gen, const SubtreeBounds& bounds, unsigned int iter, float minRadius);
+
+	// Expand up to steps symbols with turtle t; true once the tree is done
+	bool run(Turtle& t, size_t steps);
+
+private:
+	struct Frame {
+		std::string_view symbols;
+		size_t pos;
+		unsigned int depth;			// Rewrites still to apply to the symbols
+	};
+
+	const Generator& gen;
+	const SubtreeBounds& bounds;
+	float minRadius;
+	std::vector<Frame> stack;
+};
+
+// Generation of one iteration that runs a slice at a time, for callers
+// without threads (e.g. the GLUT idle callback). The rewrite position,
+// turtle and output persist between calls to step(), so huge iterations
+// build up over many frames. Results match Generator::generate().
+class GenerationTask {
+public:
+	GenerationTask(std::shared_ptr<Generator> gen, unsigned int iter, JobControl* ctl = nullptr);
+	// The same as Generator::generateAdaptive()
+	GenerationTask(std::shared_ptr<Generator> gen, unsigned int iter, float viewPixels, float threshold,
+		JobControl* ctl = nullptr);
+	~GenerationTask();
+
+	// Work until finished or past the deadline; true once geometry is ready
+	// Throws GenerationCancelled if ctl is cancelled
+	bool step(std::chrono::steady_clock::time_point deadline);
+	bool done() const { return stage == DONE; }
+	// Take the finished geometry
+	IterGeometry take() { return std::move(result); }
+
+private:
+	enum Stage { LOOKUP, MEASURING, REWRITING, INTERPRETING, DONE };
+
+	bool rewriteSlice(std::chrono::steady_clock::time_point deadline);
+	bool interpretSlice(std::chrono::steady_clock::time_point deadline);
+	// The same for parametric models, a module at a time
+	bool rewriteModuleSlice(std::chrono::steady_clock::time_point deadline);
+	bool interpretModuleSlice(std::chrono::steady_clock::time_point deadline);
+	// Adaptive tasks: the coarse walk (MEASURING), then the one kept
+	bool walkSlice(std::chrono::steady_clock::time_point deadline);
+	void startInterpreting();
+	void finish();						// Collect the turtle's segments into result
+
+	std::shared_ptr<Generator> gen;
+	JobControl* ctl;
+	Stage stage;
+	IterGeometry result;
+
+	size_t pos;							// Next symbol (or module word) of the current input string
+	size_t modulesDone;					// Parametric: modules rewritten from the input so far
+	std::string next;					// String being rewritten
+	ModuleString nextModules;			// Parametric: module string being rewritten
+	NeighbourIndex context;				// Of the input string, for context-sensitive models
+	std::mt19937 random;				// Rewriting sequence of the current iteration
+	std::unique_ptr<Turtle> turtle;		// Interpretation state
+
+	bool adapt;							// Leave out detail, as generateAdaptive() does
+	float viewPixels;
+	float threshold;
+	std::unique_ptr<SubtreeBounds> bounds;
+	std::unique_ptr<AdaptiveWalk> walk;
+};
+
+#endif
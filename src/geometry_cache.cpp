@@ -0,0 +1,157 @@
+#include "geometry_cache.hpp"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include "compiled_grammar.hpp"
+
+namespace fs = std::filesystem;
+
+GeometryCache::GeometryCache(const std::string& dir, uint64_t maxBytes) :
+	dir(dir),
+	maxBytes(maxBytes),
+	numHits(0),
+	numMisses(0) {}
+
+// Entries are named after a hash of their key
+std::string GeometryCache::entryPath(const GeometryKey& key) const {
+	static const char* digits = "0123456789abcdef";
+	uint64_t h = fnv1a(&key, sizeof(key));
+	std::string name(16, '0');
+	for (int i = 15; i >= 0; i--, h >>= 4)
+		name[i] = digits[h & 15];
+	return (fs::path(dir) / (name + ".lsg")).string();
+}
+
+std::shared_ptr<const CachedGeometry> GeometryCache::find(const GeometryKey& key) {
+	std::string path = entryPath(key);
+	std::error_code ec;
+	if (!fs::exists(path, ec)) {
+		numMisses++;
+		return nullptr;
+	}
+
+	try {
+		MappedFile file(path);
+		// Check the entry is complete and is for this key
+		bool valid = file.size() >= sizeof(GeometryBlobHeader);
+		if (valid) {
+			auto& h = *reinterpret_cast<const GeometryBlobHeader*>(file.data());
+			valid = std::memcmp(h.magic, "LSGC", 4) == 0 && h.version == VERSION &&
+				std::memcmp(&h.key, &key, sizeof(key)) == 0 &&
+				file.size() == sizeof(GeometryBlobHeader) + h.count * key.vertSize;
+		}
+
+		// Entries are only ever replaced whole, so once undamaged they stay so
+		bool seen;
+		{
+			std::lock_guard<std::mutex> lock(checkedMutex);
+			seen = checked.count(path) != 0;
+		}
+		if (valid && !seen) {
+			auto& h = *reinterpret_cast<const GeometryBlobHeader*>(file.data());
+			valid = h.checksum == fnv1a(file.data() + sizeof(GeometryBlobHeader), h.count * key.vertSize);
+			if (valid) {
+				std::lock_guard<std::mutex> lock(checkedMutex);
+				checked.insert(path);
+			}
+		}
+		if (!valid) {
+			std::cerr << "Discarding corrupt cache entry " << path << std::endl;
+			file = MappedFile();
+			fs::remove(path, ec);
+			std::lock_guard<std::mutex> lock(checkedMutex);
+			checked.erase(path);
+			numMisses++;
+			return nullptr;
+		}
+
+		// Touch the entry so eviction sees it as recently used
+		fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+		numHits++;
+		return std::make_shared<const CachedGeometry>(std::move(file));
+	} catch (const std::exception&) {
+		numMisses++;
+		return nullptr;
+	}
+}
+
+// Writes go to a temporary file that is renamed into place, so readers
+// never map a partially written entry. Failures only cost a future miss.
+void GeometryCache::store(const GeometryKey& key, const void* verts, uint64_t count,
+	int32_t trunk, int32_t branch, int32_t twig) {
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::error_code ec;
+	fs::create_directories(dir, ec);
+
+	GeometryBlobHeader h;
+	std::memset(&h, 0, sizeof(h));
+	std::memcpy(h.magic, "LSGC", 4);
+	h.version = VERSION;
+	h.key = key;
+	h.count = count;
+	h.checksum = fnv1a(verts, count * key.vertSize);
+	h.trunk = trunk;
+	h.branch = branch;
+	h.twig = twig;
+
+	std::string path = entryPath(key);
+	std::string tmp = path + ".tmp";
+	{
+		std::ofstream file(tmp, std::ios::binary);
+		file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		file.write(static_cast<const char*>(verts), count * key.vertSize);
+		if (!file) {
+			file.close();
+			fs::remove(tmp, ec);
+			return;
+		}
+	}
+	fs::rename(tmp, path, ec);
+	if (ec) {
+		fs::remove(tmp, ec);
+		return;
+	}
+	{
+		// Written from vertices in memory, so there is nothing to verify
+		std::lock_guard<std::mutex> lock(checkedMutex);
+		checked.insert(path);
+	}
+
+	evict();
+}
+
+// Delete least recently used entries until the cache fits its limit
+void GeometryCache::evict() {
+	struct Entry {
+		fs::file_time_type time;
+		uint64_t size;
+		fs::path path;
+	};
+	std::vector<Entry> entries;
+	uint64_t total = 0;
+
+	std::error_code ec;
+	for (auto& di : fs::directory_iterator(dir, ec)) {
+		if (!di.is_regular_file(ec) || di.path().extension() != ".lsg")
+			continue;
+		Entry e = { di.last_write_time(ec), di.file_size(ec), di.path() };
+		total += e.size;
+		entries.push_back(std::move(e));
+	}
+	if (total <= maxBytes) return;
+
+	std::sort(entries.begin(), entries.end(),
+		[](const Entry& a, const Entry& b) { return a.time < b.time; });
+	for (auto& e : entries) {
+		if (total <= maxBytes) break;
+		if (fs::remove(e.path, ec)) {
+			total -= e.size;
+			std::lock_guard<std::mutex> lock(checkedMutex);
+			checked.erase(e.path.string());
+		}
+	}
+}
@@ -0,0 +1,81 @@
+#ifndef GEOMETRY_CACHE_HPP
+#define GEOMETRY_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include "mapped_file.hpp"
+
+// Everything that determines the geometry of one iteration
+struct GeometryKey {
+	uint64_t modelHash;			// CompiledGrammar::hash()
+	uint32_t seed;
+	uint32_t iter;
+	float angle1;
+	float angle2;
+	uint32_t format;			// Vertex layout version
+	uint32_t vertSize;			// Bytes per vertex
+};
+
+// Header of a cache entry, followed by count vertices
+struct GeometryBlobHeader {
+	char magic[4];				// "LSGC"
+	uint32_t version;
+	GeometryKey key;
+	uint64_t count;				// Number of vertices
+	uint64_t checksum;			// FNV-1a of the vertex data
+	int32_t trunk;				// Vertices per category, as in IterData
+	int32_t branch;
+	int32_t twig;
+	int32_t pad;
+};
+
+// A cache hit: vertex data viewed straight out of the mapped entry
+class CachedGeometry {
+public:
+	explicit CachedGeometry(MappedFile&& file) : file(std::move(file)) {}
+	const GeometryBlobHeader& header() const {
+		return *reinterpret_cast<const GeometryBlobHeader*>(file.data()); }
+	const void* verts() const { return file.data() + sizeof(GeometryBlobHeader); }
+
+private:
+	MappedFile file;
+};
+
+// Directory of memory-mapped vertex blobs, evicted least-recently-used
+// once their total size exceeds the limit. Safe to share between threads.
+class GeometryCache {
+public:
+	static const uint32_t VERSION = 1;
+
+	GeometryCache(const std::string& dir, uint64_t maxBytes);
+
+	// Map the entry for key; null on a miss or if the entry is corrupt
+	// The vertex checksum is only verified the first time an entry is found
+	std::shared_ptr<const CachedGeometry> find(const GeometryKey& key);
+	// Write an entry, then evict old entries past the size limit
+	void store(const GeometryKey& key, const void* verts, uint64_t count,
+		int32_t trunk, int32_t branch, int32_t twig);
+
+	uint64_t hits() const { return numHits; }
+	uint64_t misses() const { return numMisses; }
+	const std::string& directory() const { return dir; }
+
+private:
+	std::string dir;
+	uint64_t maxBytes;
+	std::atomic<uint64_t> numHits;
+	std::atomic<uint64_t> numMisses;
+	std::mutex mutex;			// Serializes writes and eviction
+	std::mutex checkedMutex;
+	std::unordered_set<std::string> checked;	// Entries whose checksum has been verified
+
+	std::string entryPath(const GeometryKey& key) const;
+	void evict();
+};
+
+#endif
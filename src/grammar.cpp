@@ -0,0 +1,154 @@
+#include "grammar.hpp"
+#include <charconv>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// Trim leading and trailing whitespace from a view
+std::string_view trim(std::string_view str) {
+	size_t first = 0;
+	while (first < str.size() && isSpace(str[first]))
+		first++;
+	size_t last = str.size();
+	while (last > first && isSpace(str[last - 1]))
+		last--;
+	return str.substr(first, last - first);
+}
+
+// Append a view to a string, dropping any whitespace inside it
+void appendStripped(std::string& out, std::string_view str) {
+	out.reserve(out.size() + str.size());
+	for (char c : str)
+		if (!isSpace(c)) out += c;
+}
+
+std::runtime_error parseError(unsigned int line, const std::string& msg) {
+	return std::runtime_error("line " + std::to_string(line) + ": " + msg);
+}
+
+// Parse a number from a view without copying it
+double parseNumber(std::string_view str, unsigned int line) {
+	str = trim(str);
+	double value = 0.0;
+	auto res = std::from_chars(str.data(), str.data() + str.size(), value);
+	if (res.ec != std::errc() || res.ptr != str.data() + str.size())
+		throw parseError(line, "invalid number '" + std::string(str) + "'");
+	return value;
+}
+
+// Parse an "r,g,b" triple in [0,255] into a color in [0,1]
+glm::vec3 parseColor(std::string_view str, unsigned int line) {
+	auto first_pos = str.find(',');
+	auto second_pos = str.find(',', first_pos + 1);
+	if (first_pos == std::string_view::npos || second_pos == std::string_view::npos)
+		throw parseError(line, "expected a color 'r, g, b'");
+	return glm::vec3(parseNumber(str.substr(0, first_pos), line) / 255,
+		parseNumber(str.substr(first_pos + 1, second_pos - first_pos - 1), line) / 255,
+		parseNumber(str.substr(second_pos + 1), line) / 255);
+}
+
+// Turns and brackets are not neighbours in the sense of rule contexts
+bool isContext(char c) {
+	return c != '+' && c != '-' && c != '*' && c != '^' && c != '[' && c != ']';
+}
+
+// Parse a rule of the form "c:successor" or "c<prob>:successor", where c
+// may have context as in "l<c>r", "l<c" or "c>r"
+void parseRule(Grammar& g, std::string_view str, unsigned int line) {
+	auto colon = str.find(':');
+	if (colon == std::string_view::npos || colon == 0)
+		throw parseError(line, "expected a rule 'c:successor'");
+
+	std::string pred;
+	appendStripped(pred, str.substr(0, colon));
+	char left = 0, right = 0;
+	size_t i = 0;
+	if (pred.size() >= 3 && pred[1] == '<') {
+		left = pred[0];
+		i = 2;
+	}
+	char c = pred[i++];
+	if (pred.size() >= i + 2 && pred[i] == '>') {
+		right = pred[i + 1];
+		i += 2;
+	}
+	if ((left && !isContext(left)) || (right && !isContext(right)))
+		throw parseError(line, "turns and brackets cannot be context");
+	std::string_view probability = std::string_view(pred).substr(i);
+	double p = probability.empty() ? 1.0 : parseNumber(probability, line);
+
+	Data d = { p, std::string(), left, right };
+	appendStripped(d.rule, str.substr(colon + 1));
+	g.rules[c].push_back(std::move(d));
+}
+
+// Parameters and named modules need the parametric rewriter
+bool hasModules(std::string_view str) {
+	return str.find('(') != std::string_view::npos || str.find('{') != std::string_view::npos;
+}
+
+}
+
+// Walk the text once, handing each nonempty line to the parser for its field
+Grammar parseGrammar(std::string_view text) {
+	Grammar g;
+	unsigned int field = 0;			// Index of the next nonempty line
+	unsigned int lineNo = 0;
+	std::vector<std::pair<std::string_view, unsigned int>> rules;	// Rule lines and their numbers
+	bool parametric = false;
+
+	size_t pos = 0;
+	while (pos < text.size()) {
+		// Find the end of the line and cut off any comment
+		size_t end = text.find('\n', pos);
+		if (end == std::string_view::npos)
+			end = text.size();
+		std::string_view line = text.substr(pos, end - pos);
+		pos = end + 1;
+		lineNo++;
+
+		auto comment = line.find('#');
+		if (comment != std::string_view::npos)
+			line = line.substr(0, comment);
+		line = trim(line);
+		if (line.empty()) continue;
+
+		switch (field++) {
+		case 0: g.angle1 = (float)parseNumber(line, lineNo); break;
+		case 1: g.angle2 = (float)parseNumber(line, lineNo); break;
+		case 2: g.iters = (unsigned int)parseNumber(line, lineNo); break;
+		case 3: g.trunk_color = parseColor(line, lineNo); break;
+		case 4: g.branch_color = parseColor(line, lineNo); break;
+		case 5: g.twig_color = parseColor(line, lineNo); break;
+		case 6: g.leaf_color = parseColor(line, lineNo); break;
+		case 7: {
+			auto first_pos = line.find(',');
+			if (first_pos == std::string_view::npos)
+				throw parseError(lineNo, "expected intersection flags 'check, show'");
+			g.check_intersect = parseNumber(line.substr(0, first_pos), lineNo) == 1;
+			g.show_intersect_color = parseNumber(line.substr(first_pos + 1), lineNo) == 1;
+			break; }
+		case 8: appendStripped(g.axiom, line); parametric = hasModules(line); break;
+		default: rules.emplace_back(line, lineNo); parametric |= hasModules(line); break;
+		}
+	}
+
+	if (field < 9)
+		throw std::runtime_error("model ends before the axiom");
+	if (parametric) {
+		g.modules.swap(g.axiom);
+		for (auto& r : rules) {
+			g.modules += '\n';
+			appendStripped(g.modules, r.first);
+		}
+		return g;
+	}
+	for (auto& r : rules)
+		parseRule(g, r.first, r.second);
+	return g;
+}
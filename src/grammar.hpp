@@ -0,0 +1,44 @@
+#ifndef GRAMMAR_HPP
+#define GRAMMAR_HPP
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <glm/glm.hpp>
+
+struct Data {
+	double prob;
+	std::string rule;
+	char left = 0;				// Neighbours a context-sensitive rule needs, 0 for any
+	char right = 0;
+};
+
+// Contents of an L-System model file
+struct Grammar {
+	float angle1 = 0.0f;				// Angles for rotations
+	float angle2 = 0.0f;
+	unsigned int iters = 0;				// Number of iterations to generate
+	glm::vec3 trunk_color = glm::vec3(0.0f);
+	glm::vec3 branch_color = glm::vec3(0.0f);
+	glm::vec3 twig_color = glm::vec3(0.0f);
+	glm::vec3 leaf_color = glm::vec3(0.0f);
+	bool check_intersect = false;
+	bool show_intersect_color = false;
+	std::string axiom;
+	std::map<char, std::vector<Data>> rules;	// Generation rules
+	// Models with parameters, e.g. F(2), or named modules, e.g. {bud},
+	// keep the axiom and rules here as written, one per line, for
+	// ParametricGrammar; axiom and rules are then left empty
+	std::string modules;
+};
+
+// Parse model text in a single pass
+// Comments start with '#', blank lines are skipped and whitespace inside
+// a line is ignored. Rules are "c:successor", with an optional probability
+// after c and, for context-sensitive rules, "l<" before or ">r" after c.
+// Throws std::runtime_error on malformed input.
+// Parametric axioms and rules are only checked when compiled.
+Grammar parseGrammar(std::string_view text);
+
+#endif
@@ -0,0 +1,149 @@
+#define NOMINMAX
+#include "growth.hpp"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <unordered_map>
+#include "parametric.hpp"
+
+GrowthPredictor::GrowthPredictor(const CompiledGrammar& model) :
+	exact(!model.contextual()) {
+
+	std::vector<uint32_t> start;
+	for (char c : model.axiom())
+		start.push_back((unsigned char)c);
+	build(start, [&](uint32_t c) {
+		Rule rule;
+		const RuleSlot& slot = model.slot((char)c);
+		for (uint32_t i = slot.first; i < slot.first + slot.count; i++) {
+			const RuleAlt& alt = model.alts()[i];
+			if (alt.left || alt.right) continue;
+			std::vector<uint32_t> symbols;
+			for (char d : model.successor(alt))
+				symbols.push_back((unsigned char)d);
+			rule.emplace_back(alt.threshold, std::move(symbols));
+		}
+		return rule;
+	});
+}
+
+GrowthPredictor::GrowthPredictor(const ParametricGrammar& model) :
+	exact(true) {
+
+	std::vector<uint32_t> start;
+	const ModuleString& axiom = model.axiom();
+	for (size_t i = 0; i < axiom.size(); i += 1 + moduleParams(axiom[i]))
+		start.push_back(axiom[i]);
+	build(start, [&](uint32_t header) {
+		Rule rule;
+		const RuleSlot& slot = model.slot(moduleSymbol(header));
+		if (slot.count == 0 || model.alts()[slot.first].arity != moduleParams(header))
+			return rule;
+		for (uint32_t i = slot.first; i < slot.first + slot.count; i++) {
+			const ModuleAlt& alt = model.alts()[i];
+			rule.emplace_back(alt.threshold, model.successorHeaders(alt));
+		}
+		return rule;
+	});
+}
+
+void GrowthPredictor::build(const std::vector<uint32_t>& start, const std::function<Rule(uint32_t)>& rule) {
+	std::unordered_map<uint32_t, int> index;
+	auto symbol = [&](uint32_t c) {
+		auto it = index.emplace(c, (int)alphabet.size());
+		if (it.second)
+			alphabet.push_back(c);
+		return it.first->second;
+	};
+	for (uint32_t c : start)
+		axiom.push_back(symbol(c));
+
+	// Successors may bring in new symbols, which need rows of their own
+	for (size_t a = 0; a < alphabet.size(); a++) {
+		Rule r = rule(alphabet[a]);
+		std::vector<Alt> list;
+		if (r.empty()) {
+			list.push_back({ 1.0, { (int)a } });
+		}
+		else {
+			// Same choice as Generator::rewrite(): a number from 0 to 1000
+			// picks the first alternative whose threshold it does not pass
+			exact = exact && r.size() == 1;
+			double taken = 0;
+			for (auto& alt : r) {
+				double upTo = r.size() == 1 ? 1001 :
+					std::min(1001.0, std::max(taken, std::floor(alt.first) + 1));
+				Alt s = { (upTo - taken) / 1001, {} };
+				taken = upTo;
+				for (uint32_t d : alt.second)
+					s.symbols.push_back(symbol(d));
+				list.push_back(std::move(s));
+			}
+		}
+		alts.push_back(std::move(list));
+	}
+
+	for (auto& list : alts) {
+		std::map<int, double> row;
+		for (auto& alt : list)
+			for (int b : alt.symbols)
+				row[b] += alt.prob;
+		rows.emplace_back(row.begin(), row.end());
+	}
+}
+
+GrowthEstimate GrowthPredictor::predict(unsigned int iter) const {
+	size_t n = alphabet.size();
+
+	// Symbol counts, and per symbol the change in bracket level and
+	// deepest level over its expansion so far
+	std::vector<double> count(n, 0.0);
+	for (int a : axiom)
+		count[a]++;
+	std::vector<int> net(n, 0), deepest(n, 0);
+	for (size_t a = 0; a < n; a++) {
+		net[a] = alphabet[a] == '[' ? 1 : alphabet[a] == ']' ? -1 : 0;
+		deepest[a] = std::max(net[a], 0);
+	}
+
+	for (unsigned int k = 0; k < iter; k++) {
+		std::vector<double> next(n, 0.0);
+		for (size_t a = 0; a < n; a++) {
+			if (count[a] == 0) continue;
+			for (auto& e : rows[a])
+				next[e.first] += count[a] * e.second;
+		}
+		count.swap(next);
+
+		std::vector<int> nextNet(n, 0), nextDeepest(n, 0);
+		for (size_t a = 0; a < n; a++) {
+			for (size_t i = 0; i < alts[a].size(); i++) {
+				int level = 0, d = 0;
+				for (int b : alts[a][i].symbols) {
+					d = std::max(d, level + deepest[b]);
+					level += net[b];
+				}
+				nextDeepest[a] = std::max(nextDeepest[a], d);
+				if (i == 0) nextNet[a] = level;
+			}
+		}
+		net.swap(nextNet);
+		deepest.swap(nextDeepest);
+	}
+
+	GrowthEstimate e = { 0.0, { 0.0, 0.0, 0.0, 0.0 }, 0, exact };
+	int level = 0, d = 0;
+	for (int a : axiom) {
+		d = std::max(d, level + deepest[a]);
+		level += net[a];
+	}
+	e.depth = d;
+	for (size_t a = 0; a < n; a++) {
+		e.length += count[a] * (1 + moduleParams(alphabet[a]));
+		uint32_t symbol = moduleSymbol(alphabet[a]);
+		int k = symbol < 256 ? symbolCategory((char)symbol) : -1;
+		if (k >= 0)
+			e.segments[k] += count[a];
+	}
+	return e;
+}
@@ -0,0 +1,75 @@
+#ifndef GROWTH_HPP
+#define GROWTH_HPP
+
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+#include "compiled_grammar.hpp"
+
+class ParametricGrammar;
+
+// Segment category the turtle draws for a symbol: 0 trunk, 1 branch,
+// 2 twig, 3 leaf, or -1 for symbols that only turn, branch or do nothing
+inline int symbolCategory(char c) {
+	switch (c) {
+	case '+': case '-': case '*': case '^': case '[': case ']':
+	case 'N': case 'n': case 'p': case 'o': case 'i': case 's': case 'S':
+		return -1;
+	case 'G': case 'W': case 'w': return 0;
+	case 'F': case 'f': return 1;
+	case 'T': case 'Z': case 't': case 'z': return 2;
+	default: return 3;
+	}
+}
+
+// Predicted size of one derived iteration
+struct GrowthEstimate {
+	double length;				// Symbols in the string; 32-bit words for module strings
+	double segments[4];			// Segments drawn per category
+	unsigned int depth;			// Deepest bracket nesting
+	bool exact;					// Deterministic rules give exact numbers, stochastic ones expected values
+
+	double vertices() const {
+		return 2 * (segments[0] + segments[1] + segments[2] + segments[3]); }
+};
+
+// Predicts string length, segment counts and bracket depth of any
+// iteration without deriving it. Rules become a production matrix whose
+// entry (a, b) is the expected number of b in the successor of a; the
+// symbol counts of iteration k are those of the axiom times the matrix
+// k times. Bracket depth is followed per symbol in the same way, taking
+// the deepest alternative of stochastic rules, so it is an upper bound.
+// Context-sensitive rules are left out, as if their context never
+// matched, which makes predictions for those models rough estimates.
+class GrowthPredictor {
+public:
+	GrowthPredictor() : exact(true) {}
+	explicit GrowthPredictor(const CompiledGrammar& model);
+	// Follows modules by symbol and parameter count, since a rule only
+	// applies to modules with as many parameters as its predecessor, and
+	// measures length in words
+	explicit GrowthPredictor(const ParametricGrammar& model);
+
+	GrowthEstimate predict(unsigned int iter) const;
+
+private:
+	// One successor alternative over alphabet indices
+	struct Alt {
+		double prob;
+		std::vector<int> symbols;
+	};
+	// Alternatives as the model gives them: cumulative threshold and symbols
+	typedef std::vector<std::pair<double, std::vector<uint32_t>>> Rule;
+
+	void build(const std::vector<uint32_t>& start, const std::function<Rule(uint32_t)>& rule);
+
+	std::vector<uint32_t> alphabet;		// Symbols in the axiom or any successor: module headers,
+										// so characters are their byte value
+	std::vector<std::vector<std::pair<int, double>>> rows;	// Production matrix, sparse rows
+	std::vector<std::vector<Alt>> alts;	// Successors by alphabet index
+	std::vector<int> axiom;
+	bool exact;
+};
+
+#endif
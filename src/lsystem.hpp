@@ -3,15 +3,12 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <map>
+#include <memory>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
-
-struct Data {
-	double prob;
-	std::string rule;
-};
+#include "generator.hpp"
 
 class LSystem {
 public:
@@ -26,9 +23,8 @@ public:
 
 	// Replace current L-system with the contents of the stream/string/file
 	void parse(std::istream& istr);
-	void parseString(std::string string);
-	void parseFile(std::string filename);
-	glm::mat3 rotate(const float, const int);
+	void parseString(std::string_view string);
+	void parseFile(const std::string& filename);
 
 	// Generate next iteration
 	unsigned int iterate();
@@ -42,36 +38,45 @@ public:
 
 	// Data access
 	unsigned int getNumIter() const {
-		return strings.size(); }
-	std::string getString(unsigned int iter) const {
-		return strings.at(iter); }
+		return iterData.size(); }
+	size_t getVertCount(unsigned int iter) const {
+		return iterData.at(iter).count; }
+	// Approximate memory held: vertex buffer plus derived strings
+	size_t getMemoryUsage() const {
+		return bufSize + (gen ? gen->getStringBytes() : 0); }
+	// Strings are derived on demand when geometry came from the cache
+	std::string_view getString(unsigned int iter) {
+		return gen->getString(iter); }
+
+	// Reuse geometry stored by earlier runs (null disables caching)
+	void setCache(GeometryCache* c) { cache = c; }
+
+	// Generation happens in the Generator, which may be handed to another
+	// thread; the LSystem must not generate while that thread is using it
+	std::shared_ptr<Generator> getGenerator() const { return gen; }
+	// Replace the model with an already loaded generator and no iterations
+	void setGenerator(std::shared_ptr<Generator> g);
+	// Upload geometry for the next iteration, or replace the latest one
+	void addGeometry(const IterGeometry& g);
+	// Drop iterations from iters on
+	void truncate(unsigned int iters);
+	// Swap each category's colour in the first iters iterations, leaving
+	// other colours (e.g. intersection highlights) alone
+	void recolor(unsigned int iters, const glm::vec3 from[4], const glm::vec3 to[4]);
 
 	float angle1;						// Angle for rotations
 	float angle2;
+	unsigned int seed;					// Seed for stochastic rules and intersection avoidance
 
 private:
-	struct LineData {
-		glm::vec3 pos;
-		glm::vec3 color;
+	// Replace current state with a compiled model
+	void load(CompiledGrammar&& g);
+	// Generate (or fetch from the cache) geometry for iteration iter and upload it
+	void buildIter(unsigned int iter);
 
-		LineData(glm::vec3 pos_, glm::vec3 color_) : pos(pos_), color(color_) {}
-	};
+	std::shared_ptr<Generator> gen;		// Rewriting and interpretation
+	GeometryCache* cache;				// Persistent geometry cache, may be null
 
-	// Apply rules to a given string and return the result
-	std::string applyRules(std::string string);
-	// Create geometry for a given string and return the vertices
-	std::vector<LineData> createGeometry(std::string string);
-
-	std::vector<std::string> strings;	// String representation of each iteration
-	std::map<char, std::vector<Data>> rules;	// Generation rules
-	glm::vec3 trunk_color;
-	glm::vec3 branch_color;
-	glm::vec3 twig_color;
-	glm::vec3 leaf_color;
-
-	bool check_intersect;
-	bool show_intersect_color;
-	
 	int trunk;
 	int branch;
 	int twig;
@@ -88,12 +93,12 @@ private:
 
 
 	// OpenGL state
-	static const GLsizei MAX_BUF = 1 << 26;		// Maximum buffer size
+	static const GLsizei MAX_BUF = Generator::MAX_BUF;	// Maximum bytes per iteration
 	GLuint vao;							// Vertex array object
 	GLuint vbo;							// Vertex buffer
 	std::vector<IterData> iterData;		// Iteration data
 	GLsizei bufSize;					// Current size of the buffer
-	void addVerts(std::vector<LineData>& verts);	// Add iter geometry to buffer
+	void addVerts(const LineData* verts, size_t count);	// Add iter geometry to buffer
 
 	// Shared OpenGL state (shader)
 	static unsigned int refcount;		// Reference counter
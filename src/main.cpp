@@ -1,9 +1,22 @@
 #define NOMINMAX
+#include <chrono>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <filesystem>
 #include <algorithm>
+#include <random>
 #include "lsystem.hpp"
+#include "mapped_file.hpp"
+#include "worker.hpp"
+#include "scheduler.hpp"
+#include "speculator.hpp"
+#include "model_cache.hpp"
+#include "file_watcher.hpp"
+#include "batch.hpp"
+#include "arena.hpp"
+#include "optimizer.hpp"
+#include "derivation.hpp"
 #include <GL/freeglut.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/transform.hpp>
@@ -16,7 +29,11 @@ const int MENU_PREVITER = 2;				// Show previous iteration
 const int MENU_NEXTITER = 3;				// Show next iteration
 const int MENU_REPARSE = 4;					// Re-parse the last loaded file
 const int MENU_EXIT = 1;					// Exit application
-std::vector<std::string> modelFilenames;	// Paths to L-System files to load
+std::vector<std::string> modelFilenames;	// Paths to L-System files to load (empty once deleted)
+int objMenu = 0;							// Submenu listing modelFilenames
+bool menuInUse = false;						// GLUT menus cannot change while open
+const uint64_t MAX_CACHE = 256ull << 20;	// Size limit of the geometry cache
+GeometryCache geometryCache("cache", MAX_CACHE);
 
 // OpenGL state
 int width, height;
@@ -24,15 +41,74 @@ std::unique_ptr<LSystem> lsystem;
 unsigned int iter = 0;
 std::string lastFilename;
 int lastFilenameIdx = -1;
+unsigned int seed = std::random_device()();	// Seed for stochastic models, fixed by --seed
+
+// Background generation state
+std::unique_ptr<GenerationWorker> worker;
+std::unique_ptr<LSystem> pending;			// Model being loaded, shown once complete
+unsigned int loadJob = 0;					// Id of the running load job
+std::string pendingFilename;
+int pendingIdx = -1;
+unsigned int wantIter = 0;					// Iteration to show once generated
+unsigned int reloadJob = 0;					// Id of the running reparse job
+std::vector<IterGeometry> reloadGeoms;		// Changed iterations, applied when it finishes
+bool reloadInterrupted = false;				// A cancelled reparse may have left the model half updated
+bool anglesPending = false;					// Angles (or the view, with viewDetail) changed since the last regeneration was queued
+std::string windowTitle;
+const size_t SPECULATION_BUDGET = 64 << 20;	// Largest next iteration to precompute, in bytes
+std::unique_ptr<Speculator> speculator;		// Precomputes the next iteration while idle
+
+// Other models, loaded ahead of time for instant switching
+const size_t MODEL_CACHE_BUDGET = 512ull << 20;	// Memory for models not on screen
+std::unique_ptr<ModelCache> modelCache;		// Finished models, least recently used first out
+const unsigned int MAX_PREFETCHERS = 4;		// Models loaded side by side ahead of time
+std::vector<std::unique_ptr<GenerationWorker>> prefetchers;	// Load models nobody has asked for yet
+struct Prefetch {
+	std::string filename;
+	std::unique_ptr<LSystem> ls;			// Built up as iterations arrive
+};
+std::map<std::pair<size_t, unsigned int>, Prefetch> prefetches;	// By prefetcher and job id
+std::string awaitPrefetch;					// Model to show once its prefetch finishes
+bool singleThread = false;					// Generate from idle() instead of a thread
+std::chrono::milliseconds sliceBudget(4);	// Generation time per frame when single-threaded
+bool showStats = false;						// Print thread pool counters on exit
+const std::chrono::milliseconds WATCH_DEBOUNCE(250);	// Quiet time before a written file is reloaded
+std::unique_ptr<FileWatcher> watcher;		// Reports edited, added and deleted model files
+bool viewDetail = false;					// Generate new iterations only as finely as the window shows
+float detailPixels = 2.f;					// Subtrees smaller than this are drawn as one segment
+const unsigned int NO_DETAIL = ~0u;
+unsigned int detailFrom = NO_DETAIL;		// First iteration generated for the view, if any
 
 float ang = 0;
 glm::vec3 axis = glm::vec3(1.f);
 
+// Command-line tools
+int compileModel(const std::string& inFile, std::string outFile);
+int batchModel(int argc, char** argv);
+int sweepModel(int argc, char** argv);
+int optimizeModel(const std::string& inFile, unsigned int iters, unsigned int seed);
+int inspectModel(int argc, char** argv);
+
 // Initialization functions
 void initGLUT(int* argc, char** argv);
 void initMenu();
 void findModelFiles();
 
+// Background generation
+void loadModel(const std::string& filename, int idx, bool reuse = true);
+void showModel(std::unique_ptr<LSystem> ls, const std::string& filename, int idx);
+void reloadModel();
+void prefetchAround(int idx);
+void handlePrefetch(size_t from, WorkerResult& r);
+void cancelPrefetches();
+void cancelGeneration();
+void updateAngles();
+void dropDetail();
+float viewPixels();
+void handleResult(WorkerResult& r);
+void handleFileEvent(const FileWatcher::Event& e);
+int stepModel(int idx, int step);
+
 // Callback functions
 void display();
 void reshape(GLint width, GLint height);
@@ -43,13 +119,57 @@ void mouseBtn(int button, int state, int x, int y);
 void mouseMove(int x, int y);
 void idle();
 void menu(int cmd);
+void menuStatus(int status, int x, int y);
 void cleanup();
 
 // Program entry point
 int main(int argc, char** argv) {
+	// Convert a model file to the compiled binary format and exit
+	if (argc > 2 && std::string(argv[1]) == "--compile")
+		return compileModel(argv[2], argc > 3 ? argv[3] : "");
+	// Generate many seeds of one model without a window and exit
+	if (argc > 2 && std::string(argv[1]) == "--batch")
+		return batchModel(argc - 2, argv + 2);
+	// Report what the grammar optimizer does to a model and exit
+	// Arguments: model [iters] [--seed S]
+	if (argc > 2 && std::string(argv[1]) == "--optimize") {
+		unsigned int iters = 0;
+		for (int i = 3; i < argc; i++) {
+			if (std::string(argv[i]) == "--seed" && i + 1 < argc)
+				seed = std::stoul(argv[++i]);
+			else
+				iters = std::stoul(argv[i]);
+		}
+		return optimizeModel(argv[2], iters, seed);
+	}
+	// Print part of an iteration's string without deriving it and exit
+	if (argc > 3 && std::string(argv[1]) == "--inspect")
+		return inspectModel(argc - 2, argv + 2);
+	// Generate one model at many angles without a window and exit
+	if (argc > 2 && std::string(argv[1]) == "--sweep")
+		return sweepModel(argc - 2, argv + 2);
+
 	std::string configFile = "models/Cherry Blossom.txt";
-	if (argc > 1)
-		configFile = std::string(argv[1]);
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--seed" && i + 1 < argc)
+			seed = std::stoul(argv[++i]);
+		else if (arg == "--single-thread")
+			singleThread = true;
+		else if (arg == "--slice" && i + 1 < argc)
+			sliceBudget = std::chrono::milliseconds(std::stoul(argv[++i]));
+		else if (arg == "--threads" && i + 1 < argc)
+			TaskScheduler::configure(std::stoul(argv[++i]));
+		else if (arg == "--stats")
+			showStats = true;
+		else if (arg == "--detail" && i + 1 < argc) {
+			viewDetail = true;
+			detailPixels = std::stof(argv[++i]);
+		}
+		else
+			configFile = arg;
+	}
+	std::cout << "Seed " << seed << std::endl;
 
 	try {
 		// Create the window and menu
@@ -62,24 +182,29 @@ int main(int argc, char** argv) {
 		glClearDepth(1.0f);
 		glEnable(GL_DEPTH_TEST);
 
-		// Create L-System object
+		// Create L-System object and start loading the first model
 		lsystem.reset(new LSystem);
-		try {
-			if (!configFile.empty()) {
-				lsystem->parseFile(configFile);
-				lastFilename = configFile;
-
-				for (unsigned int i = 0; i < modelFilenames.size(); i++) {
-					if (configFile == modelFilenames[i])
-						lastFilenameIdx = i;
-				}
-
-				iter = lsystem->getNumIter() - 1;
-				std::cout << "Iteration " << iter << std::endl;
+		lsystem->seed = seed;
+		lsystem->setCache(&geometryCache);
+		worker.reset(new GenerationWorker(!singleThread));
+		speculator.reset(new Speculator(*worker, SPECULATION_BUDGET));
+		modelCache.reset(new ModelCache(MODEL_CACHE_BUDGET));
+		// One thread stays free for the viewer's own worker; single-threaded,
+		// prefetches only get spare frames anyway, so one at a time will do
+		unsigned int threads = TaskScheduler::global().concurrency();
+		size_t count = singleThread ? 1 : std::clamp(threads > 1 ? threads - 1 : 1, 1u, MAX_PREFETCHERS);
+		for (size_t i = 0; i < count; i++)
+			prefetchers.emplace_back(new GenerationWorker(!singleThread));
+		int idx = -1;
+		if (!configFile.empty()) {
+			for (unsigned int i = 0; i < modelFilenames.size(); i++) {
+				if (configFile == modelFilenames[i])
+					idx = i;
 			}
-		} catch (const std::exception& e) {
-			std::cerr << "Parse error: " << e.what() << std::endl;
+			loadModel(configFile, idx);
 		}
+		prefetchAround(idx);
+		watcher.reset(new FileWatcher("models", WATCH_DEBOUNCE));
 
 	}
 	catch (const std::exception& e) {
@@ -95,6 +220,289 @@ int main(int argc, char** argv) {
 	return 0;
 }
 
+// Compile a text model to a .lsb file next to it (or to outFile)
+int compileModel(const std::string& inFile, std::string outFile) {
+	if (outFile.empty())
+		outFile = fs::path(inFile).replace_extension(".lsb").string();
+	try {
+		MappedFile file(inFile);
+		CompiledGrammar model = compileOptimized(parseGrammar(file.view()));
+		model.save(outFile);
+		std::cout << "Wrote " << outFile << " (" << model.bytes().size() << " bytes)" << std::endl;
+	} catch (const std::exception& e) {
+		std::cerr << "Compile error: " << e.what() << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+// Generate variants of a model for a range of seeds, optionally writing
+// each to an OBJ file, and report the throughput
+// Arguments: model [--count N] [--seed FIRST] [--iters N] [--threads N] [--out DIR]
+int batchModel(int argc, char** argv) {
+	std::string inFile = argv[0];
+	std::string outDir;
+	unsigned int count = 100;
+	unsigned int first = 0;
+	unsigned int iters = 0;
+	try {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			if (arg != "--count" && arg != "--seed" && arg != "--iters" && arg != "--threads" && arg != "--out") {
+				std::cerr << "Unknown batch option " << arg << std::endl;
+				return -1;
+			}
+			if (i + 1 >= argc) {
+				std::cerr << "Missing value for " << arg << std::endl;
+				return -1;
+			}
+			if (arg == "--count")
+				count = std::stoul(argv[++i]);
+			else if (arg == "--seed")
+				first = std::stoul(argv[++i]);
+			else if (arg == "--iters")
+				iters = std::stoul(argv[++i]);
+			else if (arg == "--threads")
+				TaskScheduler::configure(std::stoul(argv[++i]));
+			else
+				outDir = argv[++i];
+		}
+
+		auto file = std::make_shared<const MappedFile>(inFile);
+		CompiledGrammar model = CompiledGrammar::isCompiled(file->view()) ?
+			CompiledGrammar::load(file) : compileOptimized(parseGrammar(file->view()));
+		// The viewer shows iterations 0 to iters - 1
+		if (iters == 0)
+			iters = std::max(1u, model.info().iters);
+		if (!outDir.empty())
+			fs::create_directories(outDir);
+
+		std::vector<unsigned int> seeds(count);
+		for (unsigned int i = 0; i < count; i++)
+			seeds[i] = first + i;
+		std::string stem = fs::path(inFile).stem().string();
+		std::atomic<size_t> verts(0);
+
+		// Files are written from the sink on the generating threads; the time
+		// spent writing, shared out among the threads, is taken off so that
+		// the rate is generation alone
+		std::atomic<int64_t> writeNs(0);
+		auto start = std::chrono::steady_clock::now();
+		generateBatch(model, iters - 1, seeds, [&](size_t i, const IterGeometry& geom) {
+			verts += geom.count;
+			if (outDir.empty()) return;
+			auto written = std::chrono::steady_clock::now();
+			writeObj((fs::path(outDir) / (stem + "_" + std::to_string(seeds[i]) + ".obj")).string(), geom);
+			writeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - written).count();
+		});
+		size_t threads = std::max<size_t>(1, std::min<size_t>(TaskScheduler::global().concurrency(), count));
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() -
+			writeNs * 1e-9 / threads;
+
+		std::cout << "Generated " << count << " variants of " << inFile << " (iteration " << iters - 1
+			<< ", " << verts / std::max(1u, count) << " vertices each) in " << seconds << " s" << std::endl;
+		std::cout << count / seconds << " trees/s, " << verts / seconds << " vertices/s on "
+			<< TaskScheduler::global().concurrency() << " threads" << std::endl;
+	} catch (const std::exception& e) {
+		std::cerr << "Batch error: " << e.what() << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+// Optimize a text model, compare string sizes and rewrite times before and
+// after, and check that both generate the same geometry, all with one seed
+int optimizeModel(const std::string& inFile, unsigned int iters, unsigned int seed) {
+	try {
+		MappedFile file(inFile);
+		Grammar g = parseGrammar(file.view());
+		if (!g.modules.empty())
+			throw std::runtime_error("parametric models are not optimized");
+		OptimizeStats stats;
+		CompiledGrammar before = CompiledGrammar::compile(g);
+		if (before.contextual())
+			throw std::runtime_error("context-sensitive models are not optimized");
+		CompiledGrammar after = CompiledGrammar::compile(optimizeGrammar(g, &stats));
+		if (iters == 0)
+			iters = std::max(1u, before.info().iters);
+
+		std::cout << inFile;
+		if (stats.stochastic)
+			std::cout << " (stochastic, seed " << seed << ": symbols kept in place)";
+		std::cout << std::endl;
+		std::cout << "  " << stats.identityRules << " identity rules, " << stats.mergedSymbols << " merged symbols, "
+			<< stats.deadSymbols << " dead symbols, " << stats.removedTurns << " turns and brackets removed" << std::endl;
+		for (const CompiledGrammar* m : { &before, &after }) {
+			Generator gen(*m);
+			gen.seed = seed;
+			auto start = std::chrono::steady_clock::now();
+			gen.deriveStrings(iters - 1);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cout << (m == &before ? "  before: " : "  after:  ") << gen.getString(iters - 1).size()
+				<< " symbols at iteration " << iters - 1 << ", rewriting took " << seconds * 1000 << " ms" << std::endl;
+		}
+
+		std::string why;
+		if (!equivalentGeometry(before, after, iters, seed, 1e-4f, &why)) {
+			std::cerr << "  Geometry differs: " << why << std::endl;
+			return -1;
+		}
+		std::cout << "  Geometry matches" << std::endl;
+	} catch (const std::exception& e) {
+		std::cerr << "Optimize error: " << e.what() << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+// Print the length of an iteration's string and a window of it, read
+// from the derivation index rather than by deriving the string
+// Arguments: model iteration [position [count]]
+int inspectModel(int argc, char** argv) {
+	try {
+		auto file = std::make_shared<const MappedFile>(argv[0]);
+		CompiledGrammar model = CompiledGrammar::isCompiled(file->view()) ?
+			CompiledGrammar::load(file) : compileOptimized(parseGrammar(file->view()));
+		unsigned int iter = std::stoul(argv[1]);
+		uint64_t pos = argc > 2 ? std::stoull(argv[2]) : 0;
+		uint64_t count = argc > 3 ? std::stoull(argv[3]) : 80;
+
+		DirectDerivation index(model, iter);
+		if (pos > index.length())
+			pos = index.length();
+		count = std::min(count, index.length() - pos);
+		std::cout << "Iteration " << iter << ": " << index.length() << " symbols" << std::endl;
+		std::cout << pos << ": " << index.window(pos, count) << std::endl;
+	} catch (const std::exception& e) {
+		std::cerr << "Inspect error: " << e.what() << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+// Generate frames of a model with angles stepping evenly from one pair to
+// another, optionally writing each to an OBJ file, and report the frame rate
+// Arguments: model [--frames N] [--angle1 FROM TO] [--angle2 FROM TO]
+//   [--seed S] [--iters N] [--threads N] [--out DIR] [--compare]
+// Angles default to the model's angle1 and a full turn of angle2. With
+// --compare the frames are timed again through the full interpreter.
+int sweepModel(int argc, char** argv) {
+	std::string inFile = argv[0];
+	std::string outDir;
+	unsigned int frames = 360;
+	unsigned int iters = 0;
+	unsigned int first = 0;
+	bool setAngle1 = false;
+	bool compare = false;
+	glm::vec2 from(0.f, 0.f), to(0.f, 360.f);
+	try {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			int values = arg == "--compare" ? 0 : arg == "--angle1" || arg == "--angle2" ? 2 :
+				arg == "--frames" || arg == "--seed" || arg == "--iters" || arg == "--threads" || arg == "--out" ? 1 : -1;
+			if (values < 0) {
+				std::cerr << "Unknown sweep option " << arg << std::endl;
+				return -1;
+			}
+			if (i + values >= argc) {
+				std::cerr << "Missing value for " << arg << std::endl;
+				return -1;
+			}
+			if (arg == "--angle1") {
+				from.x = std::stof(argv[++i]);
+				to.x = std::stof(argv[++i]);
+				setAngle1 = true;
+			}
+			else if (arg == "--angle2") {
+				from.y = std::stof(argv[++i]);
+				to.y = std::stof(argv[++i]);
+			}
+			else if (arg == "--compare")
+				compare = true;
+			else if (arg == "--frames")
+				frames = std::stoul(argv[++i]);
+			else if (arg == "--seed")
+				first = std::stoul(argv[++i]);
+			else if (arg == "--iters")
+				iters = std::stoul(argv[++i]);
+			else if (arg == "--threads")
+				TaskScheduler::configure(std::stoul(argv[++i]));
+			else
+				outDir = argv[++i];
+		}
+
+		auto file = std::make_shared<const MappedFile>(inFile);
+		CompiledGrammar model = CompiledGrammar::isCompiled(file->view()) ?
+			CompiledGrammar::load(file) : compileOptimized(parseGrammar(file->view()));
+		if (iters == 0)
+			iters = std::max(1u, model.info().iters);
+		if (!setAngle1)
+			from.x = to.x = model.info().angle1;
+		if (!outDir.empty())
+			fs::create_directories(outDir);
+
+		std::vector<glm::vec2> angles(frames);
+		for (unsigned int i = 0; i < frames; i++)
+			angles[i] = glm::mix(from, to, frames > 1 ? (float)i / (frames - 1) : 0.f);
+		Generator gen(std::move(model));
+		gen.seed = first;
+		std::string stem = fs::path(inFile).stem().string();
+		std::atomic<size_t> verts(0);
+
+		// Writing is taken off the time as in batchModel()
+		std::atomic<int64_t> writeNs(0);
+		auto start = std::chrono::steady_clock::now();
+		generateSweep(gen, iters - 1, angles, [&](size_t i, const IterGeometry& geom) {
+			verts += geom.count;
+			if (outDir.empty()) return;
+			auto written = std::chrono::steady_clock::now();
+			writeObj((fs::path(outDir) / (stem + "_" + std::to_string(i) + ".obj")).string(), geom);
+			writeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - written).count();
+		});
+		size_t threads = std::max<size_t>(1, std::min<size_t>(TaskScheduler::global().concurrency(), frames));
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() -
+			writeNs * 1e-9 / threads;
+
+		std::cout << "Generated " << frames << " frames of " << inFile << " (iteration " << iters - 1
+			<< ", " << verts / std::max(1u, frames) << " vertices each) in " << seconds << " s" << std::endl;
+		std::cout << frames / seconds << " frames/s, " << verts / seconds << " vertices/s on "
+			<< TaskScheduler::global().concurrency() << " threads" << std::endl;
+
+		// Same frames through createGeometry(), as generate() would run them,
+		// timing only the interpreter: the string and one Generator per
+		// thread are set up before the clock starts
+		if (compare && !gen.getModel().parametric()) {
+			std::string string;
+			gen.deriveOnly(iters - 1, string);
+			std::vector<std::unique_ptr<Generator>> gens;
+			for (size_t t = 0; t < threads; t++) {
+				gens.push_back(std::make_unique<Generator>(gen.getModel()));
+				gens.back()->seed = first;
+			}
+			start = std::chrono::steady_clock::now();
+			parallelFor(0, threads, 1, [&](size_t t, size_t) {
+				Generator& g = *gens[t];
+				for (size_t i = t; i < angles.size(); i += threads) {
+					g.angle1 = angles[i].x;
+					g.angle2 = angles[i].y;
+					ArenaScope scope;
+					int trunk, branch, twig;
+					g.createGeometry(string, iters - 1, trunk, branch, twig);
+				}
+			});
+			double full = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "Full interpreter: " << frames / full << " frames/s (sweep speed-up " << full / seconds
+				<< "x, " << (SweepProgram::vectorized() ? "vector" : "scalar") << " turtle lanes)" << std::endl;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "Sweep error: " << e.what() << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
 // Setup window and callbacks
 void initGLUT(int* argc, char** argv) {
 	// Set window and context settings
@@ -105,7 +513,8 @@ void initGLUT(int* argc, char** argv) {
 	glutInitContextProfile(GLUT_CORE_PROFILE);
 	glutInitDisplayMode(GLUT_RGBA | GLUT_DEPTH | GLUT_DOUBLE);
 	// Create the window
-	glutCreateWindow("FreeGLUT Window");
+	windowTitle = "FreeGLUT Window";
+	glutCreateWindow(windowTitle.c_str());
 
 	// Create a menu
 
@@ -118,13 +527,14 @@ void initGLUT(int* argc, char** argv) {
 	glutMouseFunc(mouseBtn);
 	glutMotionFunc(mouseMove);
 	glutIdleFunc(idle);
+	glutMenuStatusFunc(menuStatus);
 	glutCloseFunc(cleanup);
 }
 
 void initMenu() {
 	// Create a submenu with all the objects you can view
 	findModelFiles();
-	int objMenu = glutCreateMenu(menu);
+	objMenu = glutCreateMenu(menu);
 	for (int i = 0; i < modelFilenames.size(); i++) {
 		glutAddMenuEntry(modelFilenames[i].c_str(), MENU_OBJBASE + i);
 	}
@@ -141,10 +551,10 @@ void initMenu() {
 }
 
 void findModelFiles() {
-	// Search the models/ directory for any file ending in .obj
+	// Search the models/ directory for text (.txt) and compiled (.lsb) models
 	fs::path modelsDir = "models";
 	for (auto& di : fs::directory_iterator(modelsDir)) {
-		if (di.is_regular_file() && di.path().extension() == ".txt")
+		if (di.is_regular_file() && (di.path().extension() == ".txt" || di.path().extension() == ".lsb"))
 			modelFilenames.push_back(di.path().string());
 	}
 	std::sort(modelFilenames.begin(), modelFilenames.end());
@@ -152,6 +562,13 @@ void findModelFiles() {
 
 // Called whenever a screen redraw is requested
 void display() {
+	// Regenerate once per frame with the latest angles, however many key
+	// repeats arrived since the last one
+	if (anglesPending) {
+		anglesPending = false;
+		updateAngles();
+	}
+
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	float aspect = (float)width / (float)height;
@@ -172,6 +589,9 @@ void reshape(GLint w, GLint h) {
 	// Tell OpenGL the new window size
 	width = w; height = h;
 	glViewport(0, 0, w, h);
+	// Detail depends on the window size
+	if (viewDetail && lsystem)
+		anglesPending = true;
 }
 
 // Called when a key is pressed
@@ -212,28 +632,41 @@ void keyPress(unsigned char key, int x, int y) {
 		break;
 	case 't':
 		lsystem->angle1 += 1;
-		lsystem->update();
+		anglesPending = true;
 		glutPostRedisplay();
 		printf("angle1: %f\n", lsystem->angle1);
 		break;
 	case 'g':
 		lsystem->angle1 -= 1;
-		lsystem->update();
+		anglesPending = true;
 		glutPostRedisplay();
 		printf("angle1: %f\n", lsystem->angle1);
 		break;
 	case 'r':
 		lsystem->angle2 += 5;
-		lsystem->update();
+		anglesPending = true;
 		glutPostRedisplay();
 		printf("angle2: %f\n", lsystem->angle2);
 		break;
 	case 'f':
 		lsystem->angle2 -= 5;
-		lsystem->update();
+		anglesPending = true;
 		glutPostRedisplay();
 		printf("angle2: %f\n", lsystem->angle2);
 		break;
+	case 'v':
+		// Going back to full detail drops the iterations made for the view,
+		// which may be far too large to generate in full
+		viewDetail = !viewDetail;
+		if (!viewDetail) {
+			cancelGeneration();
+			speculator->discard();
+			dropDetail();
+		}
+		anglesPending = true;
+		glutPostRedisplay();
+		std::cout << "View-dependent detail " << (viewDetail ? "on" : "off") << std::endl;
+		break;
 	}
 }
 
@@ -259,18 +692,13 @@ void keySpecial(int key, int x, int y) {
 		break;
 	// Previous object
 	case GLUT_KEY_UP: {
-		int idx = lastFilenameIdx;
-		if (idx < 0) idx = 0;
-		idx--;
-		idx = (idx + modelFilenames.size()) % modelFilenames.size();
-		menu(MENU_OBJBASE + idx);
+		int idx = stepModel(lastFilenameIdx < 0 ? 0 : lastFilenameIdx, -1);
+		if (idx >= 0) menu(MENU_OBJBASE + idx);
 		break; }
 	// Next object
 	case GLUT_KEY_DOWN: {
-		int idx = lastFilenameIdx;
-		idx++;
-		idx = idx % modelFilenames.size();
-		menu(MENU_OBJBASE + idx);
+		int idx = stepModel(lastFilenameIdx, 1);
+		if (idx >= 0) menu(MENU_OBJBASE + idx);
 		break; }
 	}
 }
@@ -290,6 +718,380 @@ void idle() {
 	//auto elapsed = static_cast<float>((finish - start).count());
 	// NOTE: keep refreshing the screen
 	//if ((int)elapsed % 300 == 0) { glutPostRedisplay(); }
+
+	if (!worker) return;
+
+	// Without a thread, generation advances a slice per frame
+	// Prefetching only gets frames the viewer does not need
+	if (singleThread) {
+		worker->runFor(sliceBudget);
+		if (!worker->busy())
+			prefetchers[0]->runFor(sliceBudget);
+	}
+
+	// Upload whatever the workers have finished
+	while (auto r = worker->poll()) {
+		if (!speculator->offer(r))
+			handleResult(*r);
+	}
+	for (size_t i = 0; i < prefetchers.size(); i++) {
+		while (auto r = prefetchers[i]->poll())
+			handlePrefetch(i, *r);
+	}
+
+	// Pick up edits to the model files; they wait while a menu is open
+	if (watcher && !menuInUse) {
+		for (auto& e : watcher->poll())
+			handleFileEvent(e);
+	}
+
+	// Nothing else to do: get the next iteration ready in case it is wanted
+	if (!worker->busy() && !loadJob && !viewDetail && iter + 1 == lsystem->getNumIter() && wantIter == iter)
+		speculator->start(*lsystem);
+
+	// Show generation progress in the title bar
+	std::string status = worker->status();
+	if (!status.empty() && speculator->running())
+		status = "precomputing " + status;
+	std::string title = status.empty() ? "FreeGLUT Window" : "FreeGLUT Window - " + status;
+	if (title != windowTitle) {
+		windowTitle = title;
+		glutSetWindowTitle(windowTitle.c_str());
+	}
+}
+
+// Show a model, from memory if it has been loaded before
+// Otherwise load it in the background; the current one stays on screen
+void loadModel(const std::string& filename, int idx, bool reuse) {
+	cancelGeneration();
+	speculator->discard();
+	pendingFilename = filename;
+	pendingIdx = idx;
+
+	if (!reuse) {
+		modelCache->erase(filename);
+	} else if (auto ls = modelCache->take(filename)) {
+		showModel(std::move(ls), filename, idx);
+		return;
+	} else {
+		for (auto& p : prefetches) {
+			if (p.second.filename == filename) {
+				awaitPrefetch = filename;
+				return;
+			}
+		}
+	}
+	loadJob = worker->load(filename, seed, &geometryCache);
+}
+
+// Reparse the model on screen, regenerating only what the edit changed
+void reloadModel() {
+	if (!lsystem->getNumIter() || reloadInterrupted || reloadJob) {
+		loadModel(lastFilename, lastFilenameIdx, false);
+		return;
+	}
+	cancelGeneration();
+	speculator->discard();
+	dropDetail();
+	reloadJob = worker->reload(lsystem->getGenerator(), lastFilename, lsystem->getNumIter());
+}
+
+// Put a finished model on screen, keeping the one it replaces in memory
+void showModel(std::unique_ptr<LSystem> ls, const std::string& filename, int idx) {
+	if (lsystem)
+		dropDetail();
+	if (lsystem && lsystem->getNumIter() && !lastFilename.empty() && lastFilename != filename)
+		modelCache->put(lastFilename, std::move(lsystem));
+	lsystem = std::move(ls);
+	reloadInterrupted = false;
+	lastFilename = filename;
+	if (idx >= 0) lastFilenameIdx = idx;
+	iter = wantIter = lsystem->getNumIter() - 1;
+	std::cout << "Iteration " << iter << std::endl;
+	glutPostRedisplay();
+	prefetchAround(lastFilenameIdx);
+}
+
+// Queue loads of models not in memory, nearest to model idx first, dealt
+// out in turn to the prefetchers so that neighbours load side by side
+void prefetchAround(int idx) {
+	cancelPrefetches();
+	if (modelFilenames.empty() || modelCache->full()) return;
+
+	int n = modelFilenames.size();
+	if (idx < 0) idx = 0;
+	size_t next = 0;
+	for (int d = 0; d <= n / 2; d++) {
+		for (int i : { (idx + d) % n, (idx - d + n) % n }) {
+			const std::string& filename = modelFilenames[i];
+			if (filename.empty() || filename == lastFilename || filename == pendingFilename || modelCache->contains(filename))
+				continue;
+			bool queued = false;
+			for (auto& p : prefetches)
+				queued |= p.second.filename == filename;
+			if (!queued) {
+				size_t w = next++ % prefetchers.size();
+				prefetches[{ w, prefetchers[w]->load(filename, seed, &geometryCache) }].filename = filename;
+			}
+		}
+	}
+}
+
+void cancelPrefetches() {
+	for (auto& p : prefetchers)
+		p->cancel();
+	prefetches.clear();
+}
+
+// Build up a model prefetched by prefetchers[from], then store it (or show
+// it if it was asked for)
+void handlePrefetch(size_t from, WorkerResult& r) {
+	auto it = prefetches.find({ from, r.job });
+	if (it == prefetches.end()) return;
+	Prefetch& p = it->second;
+
+	switch (r.kind) {
+	case WorkerResult::ITERATION:
+		if (r.geom.iter == 0) {
+			p.ls.reset(new LSystem);
+			p.ls->seed = seed;
+			p.ls->setCache(&geometryCache);
+			p.ls->setGenerator(r.gen);
+		}
+		if (p.ls) {
+			try {
+				p.ls->addGeometry(r.geom);
+			} catch (const std::exception& e) {
+				// Its later results find no entry and are ignored
+				std::cerr << "Prefetch of " << p.filename << " failed: " << e.what() << std::endl;
+				if (p.filename == awaitPrefetch) {
+					awaitPrefetch.clear();
+					loadJob = worker->load(p.filename, seed, &geometryCache);
+				}
+				break;
+			}
+		}
+		return;
+
+	case WorkerResult::LOADED:
+		if (p.ls) {
+			if (p.filename == awaitPrefetch) {
+				awaitPrefetch.clear();
+				std::string filename = p.filename;
+				std::unique_ptr<LSystem> ls = std::move(p.ls);
+				prefetches.erase(it);
+				showModel(std::move(ls), filename, pendingIdx);
+				return;
+			}
+			modelCache->put(p.filename, std::move(p.ls), true);
+			// Stop once memory is full, rather than evicting what was just loaded
+			if (modelCache->full()) {
+				cancelPrefetches();
+				return;
+			}
+		}
+		break;
+
+	case WorkerResult::RELOADED:
+		// Prefetches only load
+		return;
+
+	case WorkerResult::FAILED:
+		// Load it in the foreground instead, which reports the error
+		if (p.filename == awaitPrefetch) {
+			awaitPrefetch.clear();
+			loadJob = worker->load(p.filename, seed, &geometryCache);
+		}
+		break;
+	}
+	prefetches.erase(it);
+}
+
+// Drop any generation still in flight
+void cancelGeneration() {
+	worker->cancel();
+	speculator->cancelled();
+	pending.reset();
+	loadJob = 0;
+	if (reloadJob) reloadInterrupted = true;
+	reloadJob = 0;
+	reloadGeoms.clear();
+	awaitPrefetch.clear();
+	wantIter = iter;
+}
+
+// Regenerate the latest iteration with the current angles
+// Replaces any regeneration for older angles still in flight
+void updateAngles() {
+	if (!lsystem->getNumIter()) return;
+	cancelGeneration();
+	speculator->discard();
+	unsigned int latest = lsystem->getNumIter() - 1;
+	// Models without subtree bounds come out in full either way
+	if (viewDetail && lsystem->getGenerator()->adaptive()) {
+		worker->adapt(lsystem->getGenerator(), latest, lsystem->angle1, lsystem->angle2, viewPixels(), detailPixels);
+		detailFrom = std::min(detailFrom, latest);
+	}
+	else
+		worker->update(lsystem->getGenerator(), latest, lsystem->angle1, lsystem->angle2);
+}
+
+// Go back to the iterations generated in full
+// Iteration 0 has no subtrees to leave out, so it is always complete
+void dropDetail() {
+	if (detailFrom < lsystem->getNumIter()) {
+		lsystem->truncate(std::max(1u, detailFrom));
+		iter = wantIter = std::min(iter, lsystem->getNumIter() - 1);
+	}
+	detailFrom = NO_DETAIL;
+}
+
+// Pixels from the centre of the window to its nearest edge, where the
+// model's largest extent reaches Generator::VIEW_SPAN / 2
+float viewPixels() {
+	return std::min(width, height) / 2.f;
+}
+
+// Apply one finished worker result (render thread, so GL calls are safe)
+void handleResult(WorkerResult& r) {
+	switch (r.kind) {
+	case WorkerResult::ITERATION:
+		if (r.job == reloadJob) {
+			reloadGeoms.push_back(std::move(r.geom));
+		} else if (r.job == loadJob) {
+			// Build up the new model off screen
+			if (r.geom.iter == 0) {
+				pending.reset(new LSystem);
+				pending->seed = seed;
+				pending->setCache(&geometryCache);
+				pending->setGenerator(r.gen);
+			}
+			if (pending)
+				pending->addGeometry(r.geom);
+		} else if (r.gen == lsystem->getGenerator()) {
+			try {
+				lsystem->addGeometry(r.geom);
+			} catch (const std::exception& e) {
+				std::cerr << "Too many iterations: " << e.what() << std::endl;
+				wantIter = iter;
+				break;
+			}
+			if (r.geom.iter > iter && r.geom.iter <= wantIter) {
+				iter = r.geom.iter;
+				std::cout << "Iteration " << iter << std::endl;
+			}
+			glutPostRedisplay();
+		}
+		break;
+
+	case WorkerResult::LOADED:
+		if (r.job != loadJob || !pending) break;
+		loadJob = 0;
+		showModel(std::move(pending), pendingFilename, pendingIdx);
+		break;
+
+	case WorkerResult::RELOADED: {
+		if (r.job != reloadJob) break;
+		reloadJob = 0;
+		unsigned int keep = std::min(r.keep, lsystem->getNumIter());
+		if (keep == lsystem->getNumIter() && reloadGeoms.empty() && !r.recolor) {
+			std::cout << "Model unchanged" << std::endl;
+			break;
+		}
+		if (r.recolor)
+			lsystem->recolor(keep, r.oldColors, r.newColors);
+		lsystem->truncate(keep);
+		lsystem->angle1 = r.gen->angle1;
+		lsystem->angle2 = r.gen->angle2;
+		try {
+			for (auto& g : reloadGeoms)
+				lsystem->addGeometry(g);
+		} catch (const std::exception& e) {
+			std::cerr << "Too many iterations: " << e.what() << std::endl;
+		}
+		std::cout << "Reparsed: kept " << keep << " iterations, regenerated " << reloadGeoms.size() << std::endl;
+		reloadGeoms.clear();
+		iter = wantIter = lsystem->getNumIter() - 1;
+		std::cout << "Iteration " << iter << std::endl;
+		glutPostRedisplay();
+		break; }
+
+	case WorkerResult::FAILED:
+		if (r.job == reloadJob) {
+			std::cerr << "Parse error: " << r.error << std::endl;
+			reloadJob = 0;
+			reloadGeoms.clear();
+		} else if (r.job == loadJob) {
+			std::cerr << "Parse error: " << r.error << std::endl;
+			pending.reset();
+			loadJob = 0;
+		} else {
+			std::cerr << "Iteration failed: " << r.error << std::endl;
+			wantIter = iter;
+		}
+		break;
+	}
+}
+
+// Keep the menu and the models in memory in step with the models directory
+void handleFileEvent(const FileWatcher::Event& e) {
+	auto it = std::find(modelFilenames.begin(), modelFilenames.end(), e.path);
+	int idx = it == modelFilenames.end() ? -1 : (int)(it - modelFilenames.begin());
+	bool prefetching = false;
+	for (auto& p : prefetches)
+		prefetching |= p.second.filename == e.path;
+
+	switch (e.kind) {
+	case FileWatcher::Event::ADDED:
+		// New files go at the end, so the other entries keep their ids
+		if (idx < 0) {
+			glutSetMenu(objMenu);
+			glutAddMenuEntry(e.path.c_str(), MENU_OBJBASE + (int)modelFilenames.size());
+			modelFilenames.push_back(e.path);
+			std::cout << "Added " << e.path << std::endl;
+		}
+		prefetchAround(lastFilenameIdx);
+		break;
+
+	case FileWatcher::Event::CHANGED:
+		if (e.path == pendingFilename && (loadJob || !awaitPrefetch.empty())) {
+			// Restart the load from the new contents
+			loadModel(e.path, pendingIdx, false);
+		} else if (e.path == lastFilename) {
+			std::cout << "Reloading " << e.path << std::endl;
+			reloadModel();
+		} else if (modelCache->contains(e.path) || prefetching) {
+			// Load it again in the background
+			modelCache->erase(e.path);
+			prefetchAround(lastFilenameIdx);
+		}
+		break;
+
+	case FileWatcher::Event::REMOVED:
+		if (idx < 0) break;
+		// Menu entries are numbered from 1 and deleted files have none;
+		// the slot stays so the ids after it still match
+		glutSetMenu(objMenu);
+		glutRemoveMenuItem(1 + (int)std::count_if(modelFilenames.begin(), it,
+			[](const std::string& f) { return !f.empty(); }));
+		it->clear();
+		modelCache->erase(e.path);
+		if (prefetching)
+			prefetchAround(lastFilenameIdx);
+		std::cout << "Removed " << e.path << std::endl;
+		break;
+	}
+}
+
+// Model step places away from idx, skipping deleted files; -1 if none is left
+int stepModel(int idx, int step) {
+	int n = modelFilenames.size();
+	for (int i = 1; i <= n; i++) {
+		int j = ((idx + step * i) % n + n) % n;
+		if (!modelFilenames[j].empty())
+			return j;
+	}
+	return -1;
 }
 
 // Called when a menu button is pressed
@@ -303,59 +1105,89 @@ void menu(int cmd) {
 	// Display previous iteration
 	case MENU_PREVITER:
 		if (iter != 0) {
+			cancelGeneration();
 			iter--;
+			wantIter = iter;
 			std::cout << "Iteration " << iter << std::endl;
 			glutPostRedisplay();
 		}
 		break;
 
 	// Display next iteration
+	// Iterations not generated yet are queued on the worker and shown when ready
 	case MENU_NEXTITER:
 		if (!lsystem->getNumIter()) break;
-		try {
-			if (iter + 1 >= lsystem->getNumIter())
-				lsystem->iterate();
-			iter++;
+		if (wantIter + 1 < lsystem->getNumIter()) {
+			iter = ++wantIter;
 			std::cout << "Iteration " << iter << std::endl;
 			glutPostRedisplay();
-		} catch (const std::exception& e) {
-			std::cerr << "Too many iterations: " << e.what() << std::endl;
+		} else if (viewDetail && (reloadJob || lsystem->getGenerator()->adaptive())) {
+			// Detail is bounded by the window, so any iteration fits
+			worker->adapt(lsystem->getGenerator(), ++wantIter, lsystem->angle1, lsystem->angle2,
+				viewPixels(), detailPixels);
+			detailFrom = std::min(detailFrom, wantIter);
+		} else if (!reloadJob && lsystem->getGenerator()->predictBytes(wantIter + 1) > Generator::MAX_BUF) {
+			// A reparse may be changing the rules, so only check between reparses
+			std::cerr << "Too many iterations: iteration " << wantIter + 1
+				<< " would exceed maximum buffer size" << std::endl;
+		} else {
+			// Use the precomputed iteration if there is one
+			std::unique_ptr<WorkerResult> ready;
+			switch (speculator->claim(lsystem->getGenerator(), ++wantIter, ready)) {
+			case Speculator::READY:
+				handleResult(*ready);
+				break;
+			case Speculator::RUNNING:
+				break;
+			case Speculator::NONE:
+				worker->iterate(lsystem->getGenerator(), wantIter);
+				break;
+			}
 		}
 		break;
 
 	// Re-parse last loaded file
 	case MENU_REPARSE:
-		if (!lastFilename.empty()) {
-			try {
-				lsystem->parseFile(lastFilename);
-				iter = lsystem->getNumIter() - 1;
-				std::cout << "Iteration " << iter << std::endl;
-				glutPostRedisplay();
-			} catch (const std::exception& e) {
-				std::cerr << "Parse error: " << e.what() << std::endl;
-			}
-		}
+		if (!lastFilename.empty())
+			reloadModel();
 		break;
 
 	default:
 		// Show the other objects
-		if (cmd >= MENU_OBJBASE) {
-			try {
-				lsystem->parseFile(modelFilenames[cmd - MENU_OBJBASE]);
-				lastFilename = modelFilenames[cmd - MENU_OBJBASE];
-				lastFilenameIdx = cmd - MENU_OBJBASE;
-				iter = lsystem->getNumIter() - 1;
-				std::cout << "Iteration " << iter << std::endl;
-				glutPostRedisplay();	// Request redraw
-			} catch (const std::exception& e) {
-				std::cerr << "Parse error: " << e.what() << std::endl;
-			}
-		}
+		if (cmd >= MENU_OBJBASE && !modelFilenames[cmd - MENU_OBJBASE].empty())
+			loadModel(modelFilenames[cmd - MENU_OBJBASE], cmd - MENU_OBJBASE);
 		break;
 	}
 }
 
+// Called when a menu opens or closes
+void menuStatus(int status, int x, int y) {
+	menuInUse = status == GLUT_MENU_IN_USE;
+}
+
 // Called when the window is closed or the event loop is otherwise exited
 void cleanup() {
+	// Stop the worker first; it may still hold the generator
+	if (showStats && speculator) {
+		std::cout << "Next iteration precomputed: " << speculator->hits << " hits, "
+			<< speculator->lateHits << " late hits, " << speculator->misses << " misses, "
+			<< speculator->wasted << " wasted" << std::endl;
+	}
+	watcher.reset(nullptr);
+	speculator.reset(nullptr);
+	prefetchers.clear();
+	prefetches.clear();
+	modelCache.reset(nullptr);
+	worker.reset(nullptr);
+	pending.reset(nullptr);
 	lsystem.reset(nullptr);
+
+	if (showStats) {
+		auto stats = TaskScheduler::global().stats();
+		for (size_t i = 0; i < stats.size(); i++) {
+			std::cout << (i + 1 < stats.size() ? "Worker " + std::to_string(i) : std::string("Other threads"))
+				<< ": " << stats[i].tasks << " tasks, " << stats[i].steals << " steals, "
+				<< stats[i].busy << " s busy" << std::endl;
+		}
+	}
 }
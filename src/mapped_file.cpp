@@ -0,0 +1,118 @@
+#define NOMINMAX
+#include "mapped_file.hpp"
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+// Map the whole file read-only
+MappedFile::MappedFile(const std::string& filename) : ptr(nullptr), len(0), handle(nullptr) {
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("failed to open " + filename);
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		CloseHandle(file);
+		throw std::runtime_error("failed to stat " + filename);
+	}
+	len = (std::size_t)size.QuadPart;
+	// Empty files cannot be mapped
+	if (len == 0) {
+		CloseHandle(file);
+		return;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping)
+		throw std::runtime_error("failed to map " + filename);
+	ptr = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!ptr) {
+		CloseHandle(mapping);
+		throw std::runtime_error("failed to map " + filename);
+	}
+	handle = mapping;
+}
+
+void MappedFile::unmap() {
+	if (ptr) UnmapViewOfFile(ptr);
+	if (handle) CloseHandle((HANDLE)handle);
+	ptr = nullptr;
+	len = 0;
+	handle = nullptr;
+}
+
+#else
+
+// Map the whole file read-only
+MappedFile::MappedFile(const std::string& filename) : ptr(nullptr), len(0), handle(nullptr) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("failed to open " + filename);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw std::runtime_error("failed to stat " + filename);
+	}
+	len = (std::size_t)st.st_size;
+	// Empty files cannot be mapped
+	if (len == 0) {
+		close(fd);
+		return;
+	}
+
+	void* addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		len = 0;
+		throw std::runtime_error("failed to map " + filename);
+	}
+	ptr = (const char*)addr;
+}
+
+void MappedFile::unmap() {
+	if (ptr) munmap((void*)ptr, len);
+	ptr = nullptr;
+	len = 0;
+	handle = nullptr;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+	unmap();
+}
+
+// Move constructor
+MappedFile::MappedFile(MappedFile&& other) :
+	ptr(other.ptr),
+	len(other.len),
+	handle(other.handle) {
+
+	other.ptr = nullptr;
+	other.len = 0;
+	other.handle = nullptr;
+}
+
+// Move assignment operator
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+	if (this != &other) {
+		unmap();
+		std::swap(ptr, other.ptr);
+		std::swap(len, other.len);
+		std::swap(handle, other.handle);
+	}
+	return *this;
+}
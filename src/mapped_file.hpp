@@ -0,0 +1,32 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Read-only memory mapping of an entire file
+class MappedFile {
+public:
+	MappedFile() : ptr(nullptr), len(0), handle(nullptr) {}
+	explicit MappedFile(const std::string& filename);
+	~MappedFile();
+	// Move constructor and assignment
+	MappedFile(MappedFile&& other);
+	MappedFile& operator=(MappedFile&& other);
+	// Disallow copy
+	MappedFile(const MappedFile& other) = delete;
+	MappedFile& operator=(const MappedFile& other) = delete;
+
+	const char* data() const { return ptr; }
+	std::size_t size() const { return len; }
+	std::string_view view() const { return std::string_view(ptr, len); }
+
+private:
+	const char* ptr;			// Start of the mapping (null for empty files)
+	std::size_t len;			// Length of the file in bytes
+	void* handle;				// Platform mapping handle (Windows only)
+	void unmap();
+};
+
+#endif
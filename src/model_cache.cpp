@@ -0,0 +1,46 @@
+#include "model_cache.hpp"
+
+ModelCache::ModelCache(size_t budget) :
+	budget(budget),
+	used(0) {}
+
+std::unique_ptr<LSystem> ModelCache::take(const std::string& filename) {
+	for (auto it = entries.begin(); it != entries.end(); ++it) {
+		if (it->filename == filename) {
+			std::unique_ptr<LSystem> ls = std::move(it->ls);
+			used -= it->bytes;
+			entries.erase(it);
+			return ls;
+		}
+	}
+	return nullptr;
+}
+
+void ModelCache::put(const std::string& filename, std::unique_ptr<LSystem> ls, bool prefetched) {
+	erase(filename);
+	size_t bytes = ls->getMemoryUsage();
+	Entry e = { filename, std::move(ls), bytes };
+	if (prefetched)
+		entries.push_back(std::move(e));
+	else
+		entries.push_front(std::move(e));
+	used += bytes;
+
+	// Evict from the old end, keeping at least the newest entry
+	while (used > budget && entries.size() > 1) {
+		used -= entries.back().bytes;
+		entries.pop_back();
+	}
+}
+
+void ModelCache::erase(const std::string& filename) {
+	take(filename);
+}
+
+bool ModelCache::contains(const std::string& filename) const {
+	for (auto& e : entries) {
+		if (e.filename == filename)
+			return true;
+	}
+	return false;
+}
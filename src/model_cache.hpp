@@ -0,0 +1,39 @@
+#ifndef MODEL_CACHE_HPP
+#define MODEL_CACHE_HPP
+
+#include <list>
+#include <memory>
+#include <string>
+#include "lsystem.hpp"
+
+// Finished models kept in memory, with their strings and vertex buffers,
+// so switching back to one only swaps draw state. When the total size
+// passes the budget, the least recently used models are dropped.
+class ModelCache {
+public:
+	explicit ModelCache(size_t budget);
+
+	// Remove and return the model loaded from filename, or null
+	std::unique_ptr<LSystem> take(const std::string& filename);
+	// Add a model; prefetched ones go in as least recently used, so they
+	// are the first to make room
+	void put(const std::string& filename, std::unique_ptr<LSystem> ls, bool prefetched = false);
+	void erase(const std::string& filename);
+	bool contains(const std::string& filename) const;
+
+	size_t bytes() const { return used; }
+	bool full() const { return used >= budget; }
+
+private:
+	struct Entry {
+		std::string filename;
+		std::unique_ptr<LSystem> ls;
+		size_t bytes;
+	};
+
+	std::list<Entry> entries;			// Most recently used first
+	size_t budget;						// Size limit in bytes
+	size_t used;						// Bytes held by entries
+};
+
+#endif
@@ -0,0 +1,248 @@
+#define NOMINMAX
+#include "optimizer.hpp"
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+#include "generator.hpp"
+
+// What the turtle does with a symbol: draw categories 0 to 3, one of the
+// turn and bracket symbols, or nothing
+static int behaviour(char c) {
+	static const std::string controls = "+-*^[]";
+	int k = symbolCategory(c);
+	if (k >= 0) return k;
+	size_t i = controls.find(c);
+	return i == std::string::npos ? 10 : 4 + (int)i;
+}
+
+static bool isTurn(char c) { return c == '+' || c == '-' || c == '*' || c == '^'; }
+static char inverse(char c) { return c == '+' ? '-' : c == '-' ? '+' : c == '*' ? '^' : '*'; }
+
+// Apply f to the axiom and every successor
+template <typename F>
+static void forEachString(Grammar& g, F f) {
+	f(g.axiom, true);
+	for (auto& r : g.rules)
+		for (auto& d : r.second)
+			f(d.rule, false);
+}
+
+// Replace symbols that behave the same and have equivalent rules by one of them
+// Classes start by behaviour and rule shape and are split by the classes
+// of their successors' symbols until nothing changes
+static unsigned int mergeSymbols(Grammar& g) {
+	std::set<char> symbols;
+	forEachString(g, [&](std::string& s, bool) { symbols.insert(s.begin(), s.end()); });
+	for (auto& r : g.rules)
+		symbols.insert(r.first);
+
+	std::map<char, int> cls;
+	for (char c : symbols)
+		cls[c] = 0;
+	size_t classes = 0;
+	while (true) {
+		std::map<std::vector<double>, int> ids;
+		std::map<char, int> next;
+		for (char c : symbols) {
+			std::vector<double> key = { (double)cls[c], (double)behaviour(c) };
+			auto it = g.rules.find(c);
+			if (it != g.rules.end()) {
+				double total = 0;
+				for (auto& d : it->second)
+					total += d.prob;
+				for (auto& d : it->second) {
+					key.push_back(-1);		// Separates alternatives
+					key.push_back(total > 0 ? d.prob / total : 0);
+					for (char s : d.rule)
+						key.push_back(cls[s]);
+				}
+			}
+			next[c] = ids.emplace(key, (int)ids.size()).first->second;
+		}
+		cls.swap(next);
+		if (ids.size() == classes) break;
+		classes = ids.size();
+	}
+
+	std::map<int, char> rep;
+	for (char c : symbols)
+		rep.emplace(cls[c], c);
+	unsigned int merged = 0;
+	for (char c : symbols) {
+		if (rep[cls[c]] != c) {
+			g.rules.erase(c);
+			merged++;
+		}
+	}
+	if (merged) {
+		forEachString(g, [&](std::string& s, bool) {
+			for (char& c : s)
+				c = rep[cls[c]];
+		});
+	}
+	return merged;
+}
+
+// Remove symbols whose expansions never contain anything the turtle acts on
+static unsigned int removeDead(Grammar& g) {
+	std::set<char> live;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		forEachString(g, [&](std::string& s, bool) {
+			for (char c : s) {
+				if (live.count(c)) continue;
+				bool isLive = behaviour(c) != 10;
+				auto it = g.rules.find(c);
+				if (!isLive && it != g.rules.end()) {
+					for (auto& d : it->second)
+						for (char s2 : d.rule)
+							isLive = isLive || live.count(s2);
+				}
+				if (isLive) {
+					live.insert(c);
+					changed = true;
+				}
+			}
+		});
+	}
+
+	std::set<char> dead;
+	forEachString(g, [&](std::string& s, bool) {
+		for (char c : s)
+			if (!live.count(c)) dead.insert(c);
+		s.erase(std::remove_if(s.begin(), s.end(), [&](char c) { return !live.count(c); }), s.end());
+	});
+	for (char c : dead)
+		g.rules.erase(c);
+	return dead.size();
+}
+
+// Drop turns and brackets that cannot affect anything drawn
+// Cancelling inverse turns is exact only up to rounding, so it is skipped
+// when rounding could change which segments intersect
+static unsigned int removeTurns(std::string& s, const Grammar& g, bool axiom) {
+	bool cancel = !g.check_intersect;
+	auto plain = [&](char c) { return !g.rules.count(c); };
+	std::string out;
+	std::vector<size_t> groups;			// Positions in out of unmatched '['
+	auto dropTrailingTurns = [&](size_t from) {
+		while (out.size() > from && isTurn(out.back()) && plain(out.back()))
+			out.pop_back();
+	};
+
+	for (char c : s) {
+		if (cancel && isTurn(c) && plain(c) && !out.empty() && out.back() == inverse(c) && plain(out.back())) {
+			out.pop_back();
+		}
+		else if (c == '[' && plain(c)) {
+			groups.push_back(out.size());
+			out += c;
+		}
+		else if (c == ']' && plain(c) && !groups.empty()) {
+			// Rotations at the end of a branch are undone by the ']'
+			size_t start = groups.back();
+			groups.pop_back();
+			dropTrailingTurns(start + 1);
+			if (out.size() == start + 1)
+				out.pop_back();
+			else
+				out += c;
+		}
+		else
+			out += c;
+	}
+	// Nothing follows the end of the axiom in any iteration
+	if (axiom)
+		dropTrailingTurns(groups.empty() ? 0 : groups.back() + 1);
+
+	unsigned int removed = s.size() - out.size();
+	s.swap(out);
+	return removed;
+}
+
+// Drop rules that rewrite a symbol to itself; copying it does the same
+static unsigned int removeIdentities(Grammar& g) {
+	unsigned int removed = 0;
+	for (auto it = g.rules.begin(); it != g.rules.end(); ) {
+		if (it->second.size() == 1 && it->second[0].rule == std::string(1, it->first)) {
+			it = g.rules.erase(it);
+			removed++;
+		}
+		else
+			++it;
+	}
+	return removed;
+}
+
+// Does any rule depend on its neighbours?
+static bool contextual(const Grammar& g) {
+	for (auto& r : g.rules)
+		for (auto& d : r.second)
+			if (d.left || d.right) return true;
+	return false;
+}
+
+Grammar optimizeGrammar(Grammar g, OptimizeStats* stats) {
+	OptimizeStats st;
+	if (!g.modules.empty() || contextual(g)) {
+		if (stats) *stats = st;
+		return g;
+	}
+	st.identityRules = removeIdentities(g);
+	st.mergedSymbols = mergeSymbols(g);
+
+	for (auto& r : g.rules)
+		st.stochastic = st.stochastic || r.second.size() > 1;
+	if (!st.stochastic) {
+		st.deadSymbols = removeDead(g);
+		forEachString(g, [&](std::string& s, bool axiom) {
+			st.removedTurns += removeTurns(s, g, axiom);
+		});
+		// Removing symbols can leave a rule rewriting a symbol to itself
+		st.identityRules += removeIdentities(g);
+	}
+
+	if (stats) *stats = st;
+	return g;
+}
+
+CompiledGrammar compileOptimized(const Grammar& g) {
+	return CompiledGrammar::compile(optimizeGrammar(g));
+}
+
+bool equivalentGeometry(const CompiledGrammar& a, const CompiledGrammar& b, unsigned int iters,
+	unsigned int seed, float tolerance, std::string* why) {
+
+	Generator ga(a), gb(b);
+	ga.seed = gb.seed = seed;
+	auto fail = [&](unsigned int iter, const std::string& what) {
+		if (why) {
+			std::stringstream ss;
+			ss << "iteration " << iter << ": " << what;
+			*why = ss.str();
+		}
+		return false;
+	};
+
+	for (unsigned int iter = 0; iter < iters; iter++) {
+		if (iter > 0 && ga.predictBytes(iter) > Generator::MAX_BUF)
+			break;
+		IterGeometry x = ga.generate(iter);
+		IterGeometry y = gb.generate(iter);
+		if (x.count != y.count || x.trunk != y.trunk || x.branch != y.branch || x.twig != y.twig)
+			return fail(iter, "different vertex counts");
+		for (size_t i = 0; i < x.count; i++) {
+			const LineData& p = x.verts[i];
+			const LineData& q = y.verts[i];
+			float scale = std::max(1.f, glm::length(p.pos));
+			if (glm::length(p.pos - q.pos) > tolerance * scale)
+				return fail(iter, "vertex " + std::to_string(i) + " moved");
+			if (p.color != q.color)
+				return fail(iter, "vertex " + std::to_string(i) + " changed colour");
+		}
+	}
+	return true;
+}
@@ -0,0 +1,41 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include <string>
+#include "compiled_grammar.hpp"
+#include "grammar.hpp"
+
+// What optimizeGrammar() changed
+struct OptimizeStats {
+	unsigned int identityRules = 0;		// Rules rewriting a symbol to itself, dropped
+	unsigned int mergedSymbols = 0;		// Symbols replaced by one that behaves the same
+	unsigned int deadSymbols = 0;		// Symbols that can never lead to geometry, removed
+	unsigned int removedTurns = 0;		// Turn and bracket symbols that had no effect, removed
+	bool stochastic = false;			// Only changes that keep every symbol's position were made
+};
+
+// Simplify a model's rules before any rewriting. Generated geometry stays
+// the same, up to float rounding where inverse turns are cancelled (never
+// in models that check intersections).
+// - Rules that rewrite a symbol to itself are dropped
+// - Symbols with the same drawing behaviour and equivalent rules are merged
+// For deterministic models, which have no random choices tied to string
+// positions, symbols are also removed:
+// - Symbols that never draw, turn or branch and never rewrite to one that does
+// - Adjacent inverse turns (+- -+ *^ ^*), turns just before a ']' or at the
+//   end of the axiom, and branches left empty
+// Turns and brackets that have rules of their own are left alone.
+// Parametric and context-sensitive models are returned as they are, since
+// merging or removing symbols would change which contexts match.
+Grammar optimizeGrammar(Grammar g, OptimizeStats* stats = nullptr);
+
+// Compile a parsed model after optimizing it
+CompiledGrammar compileOptimized(const Grammar& g);
+
+// Do two models generate the same geometry for iterations 0 to iters - 1?
+// Vertex positions may differ by tolerance relative to their size; why
+// receives the first difference found
+bool equivalentGeometry(const CompiledGrammar& a, const CompiledGrammar& b, unsigned int iters,
+	unsigned int seed, float tolerance, std::string* why = nullptr);
+
+#endif
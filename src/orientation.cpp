@@ -0,0 +1,141 @@
+#define NOMINMAX
+#include "orientation.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <utility>
+
+namespace {
+
+// Entries are compared after rounding to this many steps per unit. Nearby
+// but distinct rotations can round alike, so the finished table is checked
+// against the products to within PRODUCT_TOLERANCE.
+const double KEY_SCALE = 1e6;
+const double PRODUCT_TOLERANCE = 1e-9;
+// Searches kept by find(); all are dropped once this many are
+const size_t MAX_CACHED = 256;
+
+typedef std::array<long long, 9> Key;
+
+Key key(const glm::dmat3& m) {
+	Key k;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			k[i * 3 + j] = std::llround(m[i][j] * KEY_SCALE);
+	return k;
+}
+
+// Same matrices as Generator::rotate(), in double precision
+glm::dmat3 rotation(double degree, int axis) {
+	double rad = glm::radians(degree);
+	double s = std::sin(rad), c = std::cos(rad);
+	if (axis == 1)
+		return glm::dmat3(c, -s, 0, s, c, 0, 0, 0, 1);
+	return glm::dmat3(c, 0, -s, 0, 1, 0, s, 0, c);
+}
+
+// Fewest turns by degree that make a whole number of full turns, or 0 if
+// that takes more than MAX_ORIENTATIONS. exact receives the fraction of a
+// full turn the float angle stands for, in degrees.
+size_t turnOrder(float degree, double& exact) {
+	double tolerance = 1e-6 * std::max(1.0, std::abs((double)degree));
+	for (size_t n = 1; n <= OrientationGroup::MAX_ORIENTATIONS; n++) {
+		exact = std::round(degree * (double)n / 360.0) * 360.0 / n;
+		if (std::abs(degree - exact) <= tolerance)
+			return n;
+	}
+	return 0;
+}
+
+// Only the finite rotation groups hold a pair of turns of these orders
+// about perpendicular axes: cyclic when either turn is none, dihedral when
+// one is a half turn, and otherwise the tetrahedral, octahedral or
+// icosahedral group, whose turns take at most five steps
+bool canClose(float angle1, float angle2, double& exact1, double& exact2) {
+	size_t n1 = turnOrder(angle1, exact1), n2 = turnOrder(angle2, exact2);
+	if (n1 == 0 || n2 == 0)
+		return false;
+	return n1 <= 2 || n2 <= 2 || (n1 <= 5 && n2 <= 5);
+}
+
+double distance(const glm::dmat3& a, const glm::dmat3& b) {
+	double d = 0.0;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			d = std::max(d, std::abs(a[i][j] - b[i][j]));
+	return d;
+}
+
+}
+
+OrientationGroup::OrientationGroup(float angle1, float angle2) :
+	angle1(angle1),
+	angle2(angle2) {
+
+	double exact1, exact2;
+	if (!canClose(angle1, angle2, exact1, exact2))
+		return;
+	const glm::dmat3 turns[4] = { rotation(exact1, 1), rotation(-exact1, 1),
+		rotation(exact2, 2), rotation(-exact2, 2) };
+	std::vector<glm::dmat3> found = { glm::dmat3(1.0) };
+	std::map<Key, Index> index = { { key(found[0]), 0 } };
+
+	// Each orientation found is expanded by every turn in order, so the
+	// table fills in the order the orientations are numbered
+	for (size_t o = 0; o < found.size(); o++) {
+		for (int k = 0; k < 4; k++) {
+			glm::dmat3 next = found[o] * turns[k];
+			auto it = index.emplace(key(next), (Index)found.size());
+			if (it.second) {
+				if (found.size() == MAX_ORIENTATIONS) {
+					table.clear();
+					return;
+				}
+				found.push_back(next);
+			}
+			table.push_back(it.first->second);
+		}
+	}
+
+	// Every entry must be the product it stands for, not a rotation that
+	// only rounds to the same key
+	for (size_t o = 0; o < found.size(); o++) {
+		for (int k = 0; k < 4; k++) {
+			if (distance(found[o] * turns[k], found[table[o * 4 + k]]) > PRODUCT_TOLERANCE) {
+				table.clear();
+				return;
+			}
+		}
+	}
+
+	headings.reserve(found.size());
+	for (auto& m : found)
+		headings.push_back(glm::vec3(m * glm::dvec3(0.0, 1.0, 0.0)));
+}
+
+std::shared_ptr<const OrientationGroup> OrientationGroup::find(float angle1, float angle2) {
+	double exact1, exact2;
+	if (!canClose(angle1, angle2, exact1, exact2))
+		return nullptr;
+
+	static std::mutex mutex;
+	static std::map<std::pair<float, float>, std::shared_ptr<const OrientationGroup>> cache;
+	std::pair<float, float> angles(angle1, angle2);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = cache.find(angles);
+		if (it != cache.end())
+			return it->second;
+	}
+
+	// Searched outside the lock; two threads may both search a new pair
+	auto group = std::make_shared<const OrientationGroup>(angle1, angle2);
+	std::shared_ptr<const OrientationGroup> result = group->finite() ? group : nullptr;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (cache.size() >= MAX_CACHED)
+		cache.clear();
+	cache.emplace(angles, result);
+	return result;
+}
@@ -0,0 +1,46 @@
+#ifndef ORIENTATION_HPP
+#define ORIENTATION_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Every orientation the turtle can reach from upright with a model's four
+// turns, when the turns generate a finite rotation group (e.g. 90 and 90
+// degrees, or any angle dividing 360 with the other angle 0). Orientations
+// are then small integers: a turn is a lookup in a multiplication table
+// and a step a lookup of the heading, so nothing drifts however many
+// turns are taken. Found by breadth-first search in double precision on
+// the exact fractions of a full turn the angles stand for, and only for
+// angles that can close: both turns must repeat after a whole number of
+// steps, and two turns about different axes only close when one is a half
+// turn or neither takes more than five steps.
+class OrientationGroup {
+public:
+	typedef uint16_t Index;
+	static const size_t MAX_ORIENTATIONS = 1024;	// Larger groups are not tabulated
+
+	OrientationGroup(float angle1, float angle2);
+
+	// Group for a pair of angles, or null when it is not finite. Searches
+	// are kept for the whole process, so Generators share them.
+	static std::shared_ptr<const OrientationGroup> find(float angle1, float angle2);
+
+	// Did the search close before MAX_ORIENTATIONS?
+	bool finite() const { return !headings.empty(); }
+	size_t size() const { return headings.size(); }
+	// Orientation after turn k ('+', '-', '*', '^') from o; 0 is upright
+	Index turn(Index o, int k) const { return table[(size_t)o * 4 + k]; }
+	// Direction of a step in orientation o
+	const glm::vec3& heading(Index o) const { return headings[o]; }
+
+	const float angle1;
+	const float angle2;
+
+private:
+	std::vector<Index> table;			// By orientation, then turn
+	std::vector<glm::vec3> headings;
+};
+
+#endif
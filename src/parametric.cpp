@@ -0,0 +1,382 @@
+#define NOMINMAX
+#include "parametric.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <map>
+#include <stdexcept>
+
+namespace {
+
+// Expression bytecode: an opcode in the low byte, and for OP_PARAM the
+// parameter index above it; OP_CONST is followed by its value's bits
+enum Op : uint32_t { OP_CONST, OP_PARAM, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POW, OP_NEG };
+
+// Deepest evaluation stack an expression may need
+const int MAX_STACK = 16;
+
+float evaluate(const uint32_t* op, const uint32_t* end, const float* params) {
+	float stack[MAX_STACK];
+	int top = 0;
+	for (; op < end; op++) {
+		switch (*op & 0xff) {
+		case OP_CONST: std::memcpy(&stack[top++], ++op, sizeof(float)); break;
+		case OP_PARAM: stack[top++] = params[*op >> 8]; break;
+		case OP_ADD: top--; stack[top - 1] += stack[top]; break;
+		case OP_SUB: top--; stack[top - 1] -= stack[top]; break;
+		case OP_MUL: top--; stack[top - 1] *= stack[top]; break;
+		case OP_DIV: top--; stack[top - 1] /= stack[top]; break;
+		case OP_POW: top--; stack[top - 1] = std::pow(stack[top - 1], stack[top]); break;
+		case OP_NEG: stack[top - 1] = -stack[top - 1]; break;
+		}
+	}
+	return stack[0];
+}
+
+uint32_t floatBits(float f) {
+	uint32_t bits;
+	std::memcpy(&bits, &f, sizeof(bits));
+	return bits;
+}
+
+bool isNameStart(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+bool isNameChar(char c) {
+	return isNameStart(c) || (c >= '0' && c <= '9');
+}
+
+// Recursive descent over one axiom, predecessor or successor
+//   expr  := term (('+' | '-') term)*
+//   term  := unary (('*' | '/') unary)*
+//   unary := '-' unary | power
+//   power := primary ('^' unary)?
+//   primary := number | name | '(' expr ')'
+struct Parser {
+	std::string_view text;
+	std::string_view where;					// Rule or axiom, for messages
+	std::vector<std::string_view> params;	// Predecessor parameter names
+	size_t pos = 0;
+	std::vector<uint32_t> ops;
+	int depth = 0;
+	int deepest = 0;
+
+	Parser(std::string_view text, std::string_view where) : text(text), where(where) {}
+
+	std::runtime_error error(const std::string& msg) const {
+		return std::runtime_error(std::string(where) + ": " + msg);
+	}
+	bool done() const { return pos >= text.size(); }
+	char peek() const { return done() ? '\0' : text[pos]; }
+	void expect(char c) {
+		if (peek() != c)
+			throw error(std::string("expected '") + c + "'");
+		pos++;
+	}
+	void push(uint32_t op) {
+		ops.push_back(op);
+		if (++depth > deepest) deepest = depth;
+	}
+	void binary(uint32_t op) {
+		ops.push_back(op);
+		depth--;
+	}
+
+	// Module symbol: one character or a {name}
+	std::string_view symbol() {
+		if (done())
+			throw error("expected a symbol");
+		char c = text[pos];
+		if (c == '{') {
+			size_t close = text.find('}', pos);
+			if (close == std::string_view::npos || close == pos + 1)
+				throw error("expected a module name in braces");
+			std::string_view name = text.substr(pos + 1, close - pos - 1);
+			pos = close + 1;
+			return name;
+		}
+		if (c == '(' || c == ')' || c == '}' || c == ',' || c == ':')
+			throw error(std::string("unexpected '") + c + "'");
+		return text.substr(pos++, 1);
+	}
+
+	std::string_view name() {
+		size_t start = pos;
+		if (!isNameStart(peek()))
+			throw error("expected a parameter name");
+		while (isNameChar(peek()))
+			pos++;
+		return text.substr(start, pos - start);
+	}
+
+	// Compile one expression; constant ones are folded to their value
+	std::vector<uint32_t> expression() {
+		ops.clear();
+		depth = deepest = 0;
+		expr();
+		if (deepest > MAX_STACK)
+			throw error("expression too deep");
+		for (size_t i = 0; i < ops.size(); i++) {
+			if ((ops[i] & 0xff) == OP_PARAM) return ops;
+			if ((ops[i] & 0xff) == OP_CONST) i++;
+		}
+		float value = evaluate(ops.data(), ops.data() + ops.size(), nullptr);
+		return { OP_CONST, floatBits(value) };
+	}
+
+	void expr() {
+		term();
+		while (peek() == '+' || peek() == '-') {
+			char c = text[pos++];
+			term();
+			binary(c == '+' ? OP_ADD : OP_SUB);
+		}
+	}
+	void term() {
+		unary();
+		while (peek() == '*' || peek() == '/') {
+			char c = text[pos++];
+			unary();
+			binary(c == '*' ? OP_MUL : OP_DIV);
+		}
+	}
+	void unary() {
+		if (peek() == '-') {
+			pos++;
+			unary();
+			ops.push_back(OP_NEG);
+			return;
+		}
+		primary();
+		if (peek() == '^') {
+			pos++;
+			unary();
+			binary(OP_POW);
+		}
+	}
+	void primary() {
+		if (peek() == '(') {
+			pos++;
+			expr();
+			expect(')');
+			return;
+		}
+		if (isNameStart(peek())) {
+			std::string_view n = name();
+			for (size_t i = 0; i < params.size(); i++) {
+				if (params[i] == n) {
+					push(OP_PARAM | (uint32_t)i << 8);
+					return;
+				}
+			}
+			throw error("unknown parameter '" + std::string(n) + "'");
+		}
+		float value = 0.f;
+		auto res = std::from_chars(text.data() + pos, text.data() + text.size(), value);
+		if (res.ec != std::errc())
+			throw error("expected a number or parameter");
+		pos = res.ptr - text.data();
+		push(OP_CONST);
+		ops.push_back(floatBits(value));
+	}
+};
+
+}
+
+ParametricGrammar::ParametricGrammar(std::string_view source) {
+	// Pending alternatives by symbol, in file order
+	struct Pending {
+		double prob;
+		uint32_t arity;
+		std::vector<uint32_t> code;
+		bool literal;
+	};
+	std::map<uint32_t, std::vector<Pending>> rules;
+
+	// Successor modules with each parameter's bytecode behind its length;
+	// the axiom and literal successors have only constants, stored as values
+	auto modules = [&](Parser& p, bool literal, std::vector<uint32_t>& out) {
+		while (!p.done()) {
+			uint32_t symbol = intern(p.symbol());
+			std::vector<std::vector<uint32_t>> args;
+			if (p.peek() == '(') {
+				p.pos++;
+				do {
+					args.push_back(p.expression());
+				} while (p.peek() == ',' && ++p.pos);
+				p.expect(')');
+				if (args.size() > MAX_PARAMS)
+					throw p.error("too many parameters");
+			}
+			out.push_back(moduleHeader(symbol, (uint32_t)args.size()));
+			for (auto& a : args) {
+				if (literal) {
+					out.push_back(a[1]);
+					continue;
+				}
+				out.push_back((uint32_t)a.size());
+				out.insert(out.end(), a.begin(), a.end());
+			}
+		}
+	};
+
+	size_t pos = 0;
+	bool first = true;
+	while (pos <= source.size()) {
+		size_t end = std::min(source.find('\n', pos), source.size());
+		std::string_view line = source.substr(pos, end - pos);
+		pos = end + 1;
+		if (first) {
+			Parser p{ line, "axiom" };
+			modules(p, true, start);
+			first = false;
+			continue;
+		}
+		if (line.empty()) continue;
+
+		// Predecessor, optional probability, then the successor
+		size_t colon = line.find(':');
+		Parser pred{ line.substr(0, colon == std::string_view::npos ? line.size() : colon), line };
+		if (colon == std::string_view::npos)
+			throw pred.error("expected a rule 'A(x):successor'");
+		uint32_t symbol = intern(pred.symbol());
+		if (pred.peek() == '<' || pred.peek() == '>')
+			throw pred.error("context-sensitive rules cannot have parameters");
+		Parser succ{ line.substr(colon + 1), line };
+		if (pred.peek() == '(') {
+			pred.pos++;
+			do {
+				succ.params.push_back(pred.name());
+			} while (pred.peek() == ',' && ++pred.pos);
+			pred.expect(')');
+			if (succ.params.size() > MAX_PARAMS)
+				throw pred.error("too many parameters");
+		}
+		double prob = 1.0;
+		if (!pred.done()) {
+			std::string_view rest = pred.text.substr(pred.pos);
+			auto res = std::from_chars(rest.data(), rest.data() + rest.size(), prob);
+			if (res.ec != std::errc() || res.ptr != rest.data() + rest.size())
+				throw pred.error("invalid probability '" + std::string(rest) + "'");
+		}
+
+		// Successors are parsed once to see whether any parameter refers
+		// to the predecessor's, and again as values if none does
+		Pending alt = { prob, (uint32_t)succ.params.size(), {}, true };
+		modules(succ, false, alt.code);
+		for (size_t i = 0; alt.literal && i < alt.code.size(); i++) {
+			for (uint32_t n = moduleParams(alt.code[i]); n > 0; n--) {
+				alt.literal = alt.literal && alt.code[i + 1] == 2 && alt.code[i + 2] == OP_CONST;
+				i += 1 + alt.code[i + 1];
+			}
+		}
+		if (alt.literal) {
+			Parser again{ succ.text, line };
+			alt.code.clear();
+			modules(again, true, alt.code);
+		}
+		auto& list = rules[symbol];
+		if (!list.empty() && list[0].arity != alt.arity)
+			throw pred.error("alternatives take different numbers of parameters");
+		list.push_back(std::move(alt));
+	}
+
+	// Same layout and thresholds as CompiledGrammar::compile()
+	slots.assign(256 + names.size(), RuleSlot{ 0, 0 });
+	for (auto& r : rules) {
+		double total = 0;
+		for (auto& a : r.second)
+			total += a.prob;
+		RuleSlot& s = slots[r.first];
+		s.first = (uint32_t)table.size();
+		s.count = (uint32_t)r.second.size();
+		double max = 0;
+		for (size_t i = 0; i < r.second.size(); i++) {
+			const Pending& a = r.second[i];
+			if (total > 0)
+				max += 1000 * a.prob / total;
+			ModuleAlt m;
+			m.threshold = (i + 1 == r.second.size()) ? 1000.0 : max;
+			m.arity = a.arity;
+			m.offset = (uint32_t)code.size();
+			m.length = (uint32_t)a.code.size();
+			m.literal = a.literal;
+			code.insert(code.end(), a.code.begin(), a.code.end());
+			table.push_back(m);
+		}
+	}
+}
+
+// Characters are their own symbols; names are numbered as first seen
+uint32_t ParametricGrammar::intern(std::string_view name) {
+	if (name.size() == 1)
+		return (unsigned char)name[0];
+	for (size_t i = 0; i < names.size(); i++) {
+		if (names[i] == name)
+			return 256 + (uint32_t)i;
+	}
+	if (256 + names.size() >= MAX_SYMBOLS)
+		throw std::runtime_error("too many named modules");
+	names.emplace_back(name);
+	return 256 + (uint32_t)(names.size() - 1);
+}
+
+void ParametricGrammar::expand(const ModuleAlt& alt, const float* params, ModuleString& out) const {
+	const uint32_t* p = code.data() + alt.offset;
+	const uint32_t* end = p + alt.length;
+	if (alt.literal) {
+		out.insert(out.end(), p, end);
+		return;
+	}
+	while (p < end) {
+		uint32_t header = *p++;
+		out.push_back(header);
+		for (uint32_t i = moduleParams(header); i > 0; i--) {
+			uint32_t length = *p++;
+			out.push_back(floatBits(evaluate(p, p + length, params)));
+			p += length;
+		}
+	}
+}
+
+bool ParametricGrammar::stochastic() const {
+	for (auto& s : slots) {
+		if (s.count > 1)
+			return true;
+	}
+	return false;
+}
+
+std::vector<uint32_t> ParametricGrammar::successorHeaders(const ModuleAlt& alt) const {
+	std::vector<uint32_t> headers;
+	const uint32_t* p = code.data() + alt.offset;
+	const uint32_t* end = p + alt.length;
+	while (p < end) {
+		uint32_t header = *p++;
+		headers.push_back(header);
+		for (uint32_t i = moduleParams(header); i > 0; i--)
+			p += alt.literal ? 1 : 1 + *p;
+	}
+	return headers;
+}
+
+std::string ParametricGrammar::format(const uint32_t* modules, size_t words) const {
+	std::string s;
+	for (size_t i = 0; i < words; i += 1 + moduleParams(modules[i])) {
+		uint32_t symbol = moduleSymbol(modules[i]);
+		if (symbol < 256)
+			s += (char)symbol;
+		else
+			s += "{" + names.at(symbol - 256) + "}";
+		uint32_t n = moduleParams(modules[i]);
+		for (uint32_t k = 0; k < n; k++) {
+			char buf[32];
+			auto res = std::to_chars(buf, buf + sizeof(buf), moduleParam(modules + i, k));
+			s += k ? "," : "(";
+			s.append(buf, res.ptr);
+		}
+		if (n) s += ")";
+	}
+	return s;
+}
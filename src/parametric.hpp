@@ -0,0 +1,77 @@
+#ifndef PARAMETRIC_HPP
+#define PARAMETRIC_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "compiled_grammar.hpp"
+
+// Strings of parametric models are token streams: each module is a header
+// word holding its symbol in the low 16 bits and its parameter count
+// above, followed by the parameters as floats. Symbols below 256 are the
+// usual one-character symbols; named modules ({name}) count up from 256.
+typedef std::vector<uint32_t> ModuleString;
+
+inline uint32_t moduleHeader(uint32_t symbol, uint32_t params) { return symbol | params << 16; }
+inline uint32_t moduleSymbol(uint32_t header) { return header & 0xffff; }
+inline uint32_t moduleParams(uint32_t header) { return header >> 16; }
+inline float moduleParam(const uint32_t* module, uint32_t i) {
+	float f;
+	std::memcpy(&f, module + 1 + i, sizeof(f));
+	return f;
+}
+
+// One successor alternative of a parametric rule
+struct ModuleAlt {
+	double threshold;			// Cumulative probability scaled to [0,1000]
+	uint32_t arity;				// Parameters the predecessor takes
+	uint32_t offset;			// Successor template position in the code block
+	uint32_t length;
+	bool literal;				// No parameter depends on the predecessor's, so
+								// the code is the finished successor
+};
+
+// Axiom and rules of a model written with parameters or named modules,
+// e.g. "A(l):F(l)[+(30)A(l*0.7)]". Successor parameters are compiled once
+// to a small stack bytecode, so rewriting a module only evaluates them.
+// A rule applies to modules of its symbol with as many parameters as its
+// predecessor names; others are copied unchanged.
+class ParametricGrammar {
+public:
+	static const uint32_t MAX_PARAMS = 8;		// Parameters per module
+	static const uint32_t MAX_SYMBOLS = 1 << 16;
+
+	// source is the axiom, then one rule per line, as kept by parseGrammar()
+	explicit ParametricGrammar(std::string_view source);
+
+	const ModuleString& axiom() const { return start; }
+	// Alternatives for a symbol; count is 0 for symbols without rules
+	const RuleSlot& slot(uint32_t symbol) const {
+		static const RuleSlot none = { 0, 0 };
+		return symbol < slots.size() ? slots[symbol] : none; }
+	const ModuleAlt* alts() const { return table.data(); }
+	// Append the successor of an alternative to out, with its parameter
+	// expressions evaluated on params
+	void expand(const ModuleAlt& alt, const float* params, ModuleString& out) const;
+	// Module headers of an alternative's successor in order, parameters
+	// left out
+	std::vector<uint32_t> successorHeaders(const ModuleAlt& alt) const;
+	// Does some symbol have more than one alternative?
+	bool stochastic() const;
+
+	// Write modules back in model syntax, e.g. "F(2)[+A(0.7)]"
+	std::string format(const uint32_t* modules, size_t words) const;
+
+private:
+	uint32_t intern(std::string_view name);
+
+	ModuleString start;
+	std::vector<RuleSlot> slots;		// By symbol
+	std::vector<ModuleAlt> table;		// Alternatives, grouped by symbol
+	std::vector<uint32_t> code;			// Successor templates
+	std::vector<std::string> names;		// Named modules, from symbol 256
+};
+
+#endif
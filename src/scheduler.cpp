@@ -0,0 +1,175 @@
+#define NOMINMAX
+#include "scheduler.hpp"
+#include <algorithm>
+#include <chrono>
+
+// Which scheduler's worker the current thread is, if any
+static thread_local const TaskScheduler* tlsOwner = nullptr;
+static thread_local int tlsIndex = -1;
+
+static std::atomic<unsigned int> globalThreads(0);
+
+TaskScheduler::TaskScheduler(unsigned int threads) :
+	queued(0),
+	quit(false) {
+
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned int i = 0; i < threads; i++)
+		workers.emplace_back(new Worker);
+	// The caller waiting on a group makes up the last thread
+	for (unsigned int i = 0; i + 1 < threads; i++)
+		this->threads.emplace_back(&TaskScheduler::loop, this, i);
+}
+
+TaskScheduler::~TaskScheduler() {
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (auto& t : threads)
+		t.join();
+}
+
+TaskScheduler& TaskScheduler::global() {
+	static TaskScheduler sched(globalThreads);
+	return sched;
+}
+
+void TaskScheduler::configure(unsigned int threads) {
+	globalThreads = threads;
+}
+
+std::vector<TaskScheduler::WorkerStats> TaskScheduler::stats() const {
+	std::vector<WorkerStats> s;
+	for (auto& w : workers)
+		s.push_back({ w->tasks, w->steals, w->busyNs * 1e-9 });
+	return s;
+}
+
+int TaskScheduler::self() const {
+	return tlsOwner == this ? tlsIndex : -1;
+}
+
+// Workers push to their own deque; everyone else to the shared one
+void TaskScheduler::spawn(Item item) {
+	int index = self();
+	Worker& w = *workers[index < 0 ? workers.size() - 1 : index];
+	{
+		// Counted under the deque lock, so a thief never sees it uncounted
+		std::lock_guard<std::mutex> lock(w.mutex);
+		w.items.push_back(std::move(item));
+		queued++;
+	}
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+	}
+	wake.notify_one();
+}
+
+// Newest task from our own deque first, else the oldest from another
+bool TaskScheduler::runOne() {
+	if (!queued) return false;
+
+	int index = self();
+	size_t home = index < 0 ? workers.size() - 1 : index;
+	Item item;
+	bool found = false;
+	bool stolen = false;
+	{
+		Worker& w = *workers[home];
+		std::lock_guard<std::mutex> lock(w.mutex);
+		if (!w.items.empty()) {
+			item = std::move(w.items.back());
+			w.items.pop_back();
+			queued--;
+			found = true;
+		}
+	}
+	for (size_t i = 1; !found && i < workers.size(); i++) {
+		Worker& w = *workers[(home + i) % workers.size()];
+		std::lock_guard<std::mutex> lock(w.mutex);
+		if (!w.items.empty()) {
+			item = std::move(w.items.front());
+			w.items.pop_front();
+			queued--;
+			found = stolen = true;
+		}
+	}
+	if (!found) return false;
+
+	Worker& w = *workers[home];
+	if (stolen) w.steals++;
+	execute(item, w);
+	return true;
+}
+
+void TaskScheduler::execute(Item& item, Worker& self) {
+	TaskGroup& group = *item.group;
+	if (!group.cancelled()) {
+		auto start = std::chrono::steady_clock::now();
+		try {
+			item.fn();
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(group.errorMutex);
+			if (!group.error)
+				group.error = std::current_exception();
+		}
+		self.busyNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count();
+		self.tasks++;
+	}
+	// Last touch of the group; its owner may return from wait() after this
+	if (group.pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		// Wake the owner if it is sleeping in wait()
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		wake.notify_all();
+	}
+}
+
+void TaskScheduler::loop(unsigned int index) {
+	tlsOwner = this;
+	tlsIndex = index;
+	while (true) {
+		if (runOne()) continue;
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wake.wait(lock, [this] { return quit || queued > 0; });
+		if (quit) return;
+	}
+}
+
+TaskGroup::TaskGroup(TaskScheduler& sched, const std::atomic<bool>* cancelled) :
+	sched(sched),
+	cancel(cancelled),
+	pending(0) {}
+
+TaskGroup::~TaskGroup() {
+	// Tasks refer to the group, so they must all finish first
+	try {
+		wait();
+	} catch (...) {}
+}
+
+void TaskGroup::run(std::function<void()> fn) {
+	pending++;
+	sched.spawn({ std::move(fn), this });
+}
+
+// Help run tasks until every task of this group has finished, and sleep
+// while the last ones run elsewhere
+void TaskGroup::wait() {
+	while (pending.load(std::memory_order_acquire)) {
+		if (sched.runOne()) continue;
+		std::unique_lock<std::mutex> lock(sched.sleepMutex);
+		sched.wake.wait(lock, [this] {
+			return !pending.load(std::memory_order_acquire) || sched.queued > 0; });
+	}
+	if (error) {
+		std::exception_ptr e = error;
+		error = nullptr;
+		std::rethrow_exception(e);
+	}
+}
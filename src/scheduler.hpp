@@ -0,0 +1,120 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+// Work-stealing thread pool shared by every generation stage
+// Each worker has its own deque: it pushes and pops tasks at the back and
+// idle workers steal from the front of the others. Threads that are not
+// workers queue tasks on a shared injection deque. A thread waiting on a
+// TaskGroup runs queued tasks meanwhile, so tasks may fork and join their
+// own subtasks without tying up a worker, and sleeps once there are none.
+class TaskScheduler {
+public:
+	// Counters for one worker (the last entry is for non-worker threads)
+	struct WorkerStats {
+		uint64_t tasks;					// Tasks run
+		uint64_t steals;				// Tasks taken from another deque
+		double busy;					// Seconds spent running tasks
+	};
+
+	// threads counts the calling thread too; 0 means one per hardware thread
+	explicit TaskScheduler(unsigned int threads = 0);
+	~TaskScheduler();
+	TaskScheduler(const TaskScheduler& other) = delete;
+	TaskScheduler& operator=(const TaskScheduler& other) = delete;
+
+	// Pool used by generation; configure() only has an effect before first use
+	static TaskScheduler& global();
+	static void configure(unsigned int threads);
+
+	// Threads that can run tasks at once, including one waiting caller
+	unsigned int concurrency() const { return workers.size(); }
+	std::vector<WorkerStats> stats() const;
+
+private:
+	friend class TaskGroup;
+
+	struct Item {
+		std::function<void()> fn;
+		TaskGroup* group;
+	};
+
+	struct Worker {
+		std::mutex mutex;				// Guards items
+		std::deque<Item> items;
+		std::atomic<uint64_t> tasks{ 0 };
+		std::atomic<uint64_t> steals{ 0 };
+		std::atomic<uint64_t> busyNs{ 0 };
+	};
+
+	void spawn(Item item);
+	bool runOne();						// Run one queued task if there is any
+	void execute(Item& item, Worker& self);
+	void loop(unsigned int index);		// Worker thread body
+	int self() const;					// This thread's deque index, or -1
+
+	// Deques 0..n-2 belong to worker threads, the last one takes tasks
+	// from all other threads
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	std::mutex sleepMutex;
+	std::condition_variable wake;		// New tasks, or a group has finished
+	std::atomic<size_t> queued;			// Tasks sitting in any deque
+	bool quit;
+};
+
+// Set of tasks that are forked together and joined with wait()
+// Tasks not yet started when the cancel flag is raised are skipped. The
+// first exception thrown by a task is rethrown from wait().
+class TaskGroup {
+public:
+	explicit TaskGroup(TaskScheduler& sched = TaskScheduler::global(),
+		const std::atomic<bool>* cancelled = nullptr);
+	~TaskGroup();
+	TaskGroup(const TaskGroup& other) = delete;
+	TaskGroup& operator=(const TaskGroup& other) = delete;
+
+	void run(std::function<void()> fn);
+	void wait();
+	bool cancelled() const { return cancel && *cancel; }
+
+private:
+	friend class TaskScheduler;
+
+	TaskScheduler& sched;
+	const std::atomic<bool>* cancel;
+	std::atomic<size_t> pending;
+	std::mutex errorMutex;
+	std::exception_ptr error;
+};
+
+// Run body(lo, hi) over [begin, end) in chunks of at most grain elements
+template <typename Body>
+void parallelFor(size_t begin, size_t end, size_t grain, const Body& body,
+	const std::atomic<bool>* cancelled = nullptr) {
+
+	if (end - begin <= grain) {
+		if (begin < end) body(begin, end);
+		return;
+	}
+	TaskGroup group(TaskScheduler::global(), cancelled);
+	for (size_t lo = begin; lo < end; lo += grain) {
+		size_t hi = end - lo < grain ? end : lo + grain;
+		group.run([&body, lo, hi] { body(lo, hi); });
+	}
+	group.wait();
+}
+
+#endif
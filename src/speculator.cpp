@@ -0,0 +1,78 @@
+#include "speculator.hpp"
+
+Speculator::Speculator(GenerationWorker& worker, size_t budget) :
+	worker(worker),
+	budget(budget),
+	job(0),
+	iter(0),
+	kept(0) {}
+
+void Speculator::start(const LSystem& ls) {
+	unsigned int n = ls.getNumIter();
+	auto g = ls.getGenerator();
+	if (!n || (g == gen && iter == n))
+		return;
+	discard();
+	gen = g;
+	iter = n;
+
+	// Called while the worker is idle, so gen's strings are not changing
+	size_t bytes = gen->predictBytes(iter);
+	if (bytes > Generator::MAX_BUF || bytes + gen->predictStringBytes(iter) > budget)
+		return;
+	kept = gen->getStringCount();
+
+	job = worker.iterate(gen, iter);
+}
+
+bool Speculator::offer(std::unique_ptr<WorkerResult>& r) {
+	if (!job || r->job != job)
+		return false;
+	job = 0;
+	if (r->kind == WorkerResult::ITERATION)
+		ready = std::move(r);
+	else {
+		wasted++;
+		worker.trim(gen, kept);
+	}
+	r.reset();
+	return true;
+}
+
+Speculator::Claim Speculator::claim(const std::shared_ptr<Generator>& g, unsigned int i,
+	std::unique_ptr<WorkerResult>& out) {
+
+	if (g != gen || i != iter || (!job && !ready)) {
+		misses++;
+		return NONE;
+	}
+	// The iteration is the model's now, and so is its string
+	gen.reset();
+	if (ready) {
+		hits++;
+		out = std::move(ready);
+		return READY;
+	}
+	// Let the running job's result through as an ordinary one
+	lateHits++;
+	job = 0;
+	return RUNNING;
+}
+
+void Speculator::cancelled() {
+	if (!job) return;
+	wasted++;
+	job = 0;
+	worker.trim(gen, kept);
+	gen.reset();
+}
+
+void Speculator::discard() {
+	if (job || ready) {
+		wasted++;
+		worker.trim(gen, kept);
+	}
+	job = 0;
+	ready.reset();
+	gen.reset();
+}
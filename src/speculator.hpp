@@ -0,0 +1,53 @@
+#ifndef SPECULATOR_HPP
+#define SPECULATOR_HPP
+
+#include <cstdint>
+#include <memory>
+#include "lsystem.hpp"
+#include "worker.hpp"
+
+// Precomputes the iteration after the latest one while the viewer is idle,
+// so that stepping forward usually finds its geometry already made.
+// The result is held off the GPU until it is claimed, and thrown away if
+// the model changes first, along with the string the job derived.
+class Speculator {
+public:
+	// Outcome of claiming the next iteration
+	enum Claim {
+		NONE,					// Nothing precomputed; generate it now
+		RUNNING,				// Being generated; arrives as a normal result
+		READY					// Finished; handed back to the caller
+	};
+
+	Speculator(GenerationWorker& worker, size_t budget);
+
+	// Start on the next iteration of ls unless it is already done, has been
+	// tried, or its geometry and string are expected to exceed the budget
+	void start(const LSystem& ls);
+	// Keep r if it belongs to the speculative job; true if it was taken
+	bool offer(std::unique_ptr<WorkerResult>& r);
+	// Take iteration iter of gen if it was precomputed (READY fills out)
+	Claim claim(const std::shared_ptr<Generator>& gen, unsigned int iter,
+		std::unique_ptr<WorkerResult>& out);
+	bool running() const { return job != 0; }
+	// The worker's jobs were cancelled; a finished result is still good
+	void cancelled();
+	// The model or its angles changed; drop any speculation
+	void discard();
+
+	uint64_t hits = 0;			// Claims served by a finished result
+	uint64_t lateHits = 0;		// Claims that joined a running job
+	uint64_t misses = 0;		// Claims with nothing precomputed
+	uint64_t wasted = 0;		// Speculative jobs thrown away or failed
+
+private:
+	GenerationWorker& worker;
+	size_t budget;				// Largest geometry plus strings to precompute, in bytes
+	unsigned int job;			// Running speculative job, or 0
+	std::shared_ptr<Generator> gen;		// Generator and iteration speculated on
+	unsigned int iter;
+	unsigned int kept;			// Strings gen had before the job, restored when dropped
+	std::unique_ptr<WorkerResult> ready;	// Finished result awaiting a claim
+};
+
+#endif
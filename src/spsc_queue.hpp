@@ -0,0 +1,47 @@
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Fixed-capacity lock-free queue for exactly one producer thread and one
+// consumer thread. Holds up to N - 1 items.
+template <typename T, std::size_t N>
+class SpscQueue {
+public:
+	SpscQueue() : head(0), tail(0) {}
+	SpscQueue(const SpscQueue& other) = delete;
+	SpscQueue& operator=(const SpscQueue& other) = delete;
+
+	// Producer: returns false (leaving item untouched) if the queue is full
+	bool push(T& item) {
+		std::size_t h = head.load(std::memory_order_relaxed);
+		std::size_t next = (h + 1) % N;
+		if (next == tail.load(std::memory_order_acquire))
+			return false;
+		items[h] = std::move(item);
+		head.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer: returns false if the queue is empty
+	bool pop(T& item) {
+		std::size_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return false;
+		item = std::move(items[t]);
+		tail.store((t + 1) % N, std::memory_order_release);
+		return true;
+	}
+
+	bool empty() const {
+		return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire); }
+
+private:
+	T items[N];
+	std::atomic<std::size_t> head;		// Next slot to write (producer)
+	std::atomic<std::size_t> tail;		// Next slot to read (consumer)
+};
+
+#endif
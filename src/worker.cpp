@@ -0,0 +1,384 @@
+#define NOMINMAX
+#include "worker.hpp"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include "mapped_file.hpp"
+#include "optimizer.hpp"
+
+GenerationWorker::GenerationWorker(bool threaded) :
+	threaded(threaded),
+	currentIter(0),
+	currentReload(false),
+	nextId(1),
+	quit(false),
+	cancelledId(0) {
+
+	if (threaded)
+		thread = std::thread(&GenerationWorker::run, this);
+}
+
+GenerationWorker::~GenerationWorker() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+		jobs.clear();
+		if (current) current->cancelled = true;
+	}
+	wake.notify_all();
+	if (thread.joinable())
+		thread.join();
+}
+
+unsigned int GenerationWorker::load(const std::string& filename, unsigned int seed, GeometryCache* cache) {
+	Job job = {};
+	job.kind = Job::LOAD;
+	job.filename = filename;
+	job.seed = seed;
+	job.cache = cache;
+	return submit(std::move(job));
+}
+
+unsigned int GenerationWorker::iterate(std::shared_ptr<Generator> gen, unsigned int iter) {
+	Job job = {};
+	job.kind = Job::ITERATE;
+	job.gen = std::move(gen);
+	job.iter = iter;
+	return submit(std::move(job));
+}
+
+unsigned int GenerationWorker::update(std::shared_ptr<Generator> gen, unsigned int iter, float angle1, float angle2) {
+	Job job = {};
+	job.kind = Job::UPDATE;
+	job.gen = std::move(gen);
+	job.iter = iter;
+	job.angle1 = angle1;
+	job.angle2 = angle2;
+	return submit(std::move(job));
+}
+
+unsigned int GenerationWorker::adapt(std::shared_ptr<Generator> gen, unsigned int iter, float angle1, float angle2,
+	float viewPixels, float threshold) {
+	Job job = {};
+	job.kind = Job::ADAPT;
+	job.gen = std::move(gen);
+	job.iter = iter;
+	job.angle1 = angle1;
+	job.angle2 = angle2;
+	job.viewPixels = viewPixels;
+	job.threshold = threshold;
+	return submit(std::move(job));
+}
+
+unsigned int GenerationWorker::reload(std::shared_ptr<Generator> gen, const std::string& filename, unsigned int iters) {
+	Job job = {};
+	job.kind = Job::RELOAD;
+	job.gen = std::move(gen);
+	job.filename = filename;
+	job.iter = iters;
+	return submit(std::move(job));
+}
+
+unsigned int GenerationWorker::trim(std::shared_ptr<Generator> gen, unsigned int keep) {
+	Job job = {};
+	job.kind = Job::TRIM;
+	job.gen = std::move(gen);
+	job.iter = keep;
+	return submit(std::move(job));
+}
+
+// Parse a text model, or map a compiled one
+static CompiledGrammar readModel(const std::string& filename) {
+	auto file = std::make_shared<const MappedFile>(filename);
+	if (CompiledGrammar::isCompiled(file->view()))
+		return CompiledGrammar::load(std::move(file));
+	return compileOptimized(parseGrammar(file->view()));
+}
+
+unsigned int GenerationWorker::submit(Job job) {
+	unsigned int id;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		id = job.id = nextId++;
+		jobs.push_back(std::move(job));
+	}
+	wake.notify_one();
+	return id;
+}
+
+void GenerationWorker::cancel() {
+	std::unique_lock<std::mutex> lock(mutex);
+	jobs.erase(std::remove_if(jobs.begin(), jobs.end(),
+		[](const Job& j) { return j.kind != Job::TRIM; }), jobs.end());
+	if (current) current->cancelled = true;
+	cancelledId = nextId - 1;
+	// The caller goes on using the Generator once this returns
+	if (threaded)
+		idle.wait(lock, [this] { return !current || !currentReload; });
+}
+
+std::unique_ptr<WorkerResult> GenerationWorker::poll() {
+	std::unique_ptr<WorkerResult> result;
+	while (results.pop(result) || !overflow.empty()) {
+		if (!result) {
+			result = std::move(overflow.front());
+			overflow.pop_front();
+		}
+		if (result->job > cancelledId)
+			return result;
+		result.reset();
+	}
+	return nullptr;
+}
+
+bool GenerationWorker::busy() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return current || !jobs.empty();
+}
+
+std::string GenerationWorker::status() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!current) return jobs.empty() ? "" : "waiting";
+	std::stringstream ss;
+	ss << "iteration " << currentIter << ": "
+		<< (current->stage == JobControl::REWRITING ? "rewriting " : "interpreting ")
+		<< (int)(current->progress * 100) << "%";
+	return ss.str();
+}
+
+// Take jobs off the queue until told to quit
+void GenerationWorker::run() {
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this] { return quit || !jobs.empty(); });
+			if (quit) return;
+		}
+		std::unique_ptr<Active> a = start();
+		if (!a) continue;
+		try {
+			advance(*a, std::chrono::steady_clock::time_point::max());
+		} catch (const GenerationCancelled&) {
+			// Superseded; nothing to report
+		} catch (const std::exception& e) {
+			fail(*a, e);
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			current.reset();
+		}
+		idle.notify_all();
+	}
+}
+
+// Run jobs on the calling thread until the budget is spent
+// The job in progress is kept for the next call
+void GenerationWorker::runFor(std::chrono::steady_clock::duration budget) {
+	auto deadline = std::chrono::steady_clock::now() + budget;
+	while (std::chrono::steady_clock::now() < deadline) {
+		if (!active && !(active = start()))
+			return;
+		try {
+			if (!advance(*active, deadline))
+				return;
+		} catch (const GenerationCancelled&) {
+			// Superseded; nothing to report
+		} catch (const std::exception& e) {
+			fail(*active, e);
+		}
+		active.reset();
+		std::lock_guard<std::mutex> lock(mutex);
+		current.reset();
+	}
+}
+
+std::unique_ptr<GenerationWorker::Active> GenerationWorker::start() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (jobs.empty()) return nullptr;
+	auto a = std::make_unique<Active>();
+	a->job = std::move(jobs.front());
+	jobs.pop_front();
+	a->ctl = std::make_shared<JobControl>();
+	current = a->ctl;
+	currentIter = a->job.iter;
+	currentReload = a->job.kind == Job::RELOAD;
+	return a;
+}
+
+// Report a job that stopped with an error
+void GenerationWorker::fail(Active& a, const std::exception& e) {
+	auto result = std::make_unique<WorkerResult>();
+	result->kind = WorkerResult::FAILED;
+	result->job = a.job.id;
+	result->gen = a.job.gen;
+	result->error = e.what();
+	post(std::move(result), *a.ctl);
+
+	// Later iterations are derived from this one and would only fail after
+	// it, so drop them rather than report them as errors of their own
+	if (a.job.kind == Job::ITERATE) {
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [&](const Job& j) {
+			return j.kind == Job::ITERATE && j.gen == a.job.gen && j.iter > a.job.iter;
+		}), jobs.end());
+	}
+}
+
+bool GenerationWorker::advance(Active& a, std::chrono::steady_clock::time_point deadline) {
+	Job& job = a.job;
+	// Trims only free memory, so they run even if cancelled
+	if (a.ctl->cancelled && job.kind != Job::TRIM)
+		throw GenerationCancelled();
+
+	// Hands one iteration's geometry to the render thread
+	auto postIter = [&](IterGeometry&& geom) {
+		auto result = std::make_unique<WorkerResult>();
+		result->kind = WorkerResult::ITERATION;
+		result->job = job.id;
+		result->gen = job.gen;
+		result->geom = std::move(geom);
+		post(std::move(result), *a.ctl);
+	};
+
+	IterGeometry geom;
+	switch (job.kind) {
+	case Job::LOAD: {
+		if (!job.gen) {
+			CompiledGrammar model = readModel(job.filename);
+			a.iters = model.info().iters;
+			job.gen = std::make_shared<Generator>(std::move(model));
+			job.gen->seed = job.seed;
+			job.gen->cache = job.cache;
+		}
+
+		// Stop early, like LSystem::load, at an iteration too big for the buffer
+		for (; a.next == 0 || a.next < a.iters; a.next++) {
+			// Refuse iterations predicted not to fit before generating them
+			if (a.next > 0 && job.gen->predictBytes(a.next) > Generator::MAX_BUF) {
+				std::cerr << "Too many iterations: iteration " << a.next << " would exceed maximum buffer size" << std::endl;
+				break;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				currentIter = a.next;
+			}
+			if (!produce(a, a.next, deadline, geom))
+				return false;
+			if (a.next > 0 && geom.count * sizeof(LineData) > Generator::MAX_BUF) {
+				std::cerr << "Too many iterations: geometry exceeds maximum buffer size" << std::endl;
+				break;
+			}
+			postIter(std::move(geom));
+		}
+
+		auto result = std::make_unique<WorkerResult>();
+		result->kind = WorkerResult::LOADED;
+		result->job = job.id;
+		result->gen = job.gen;
+		post(std::move(result), *a.ctl);
+		return true; }
+
+	case Job::RELOAD: {
+		if (!a.done) {
+			CompiledGrammar model = readModel(job.filename);
+			const CompiledGrammar& old = job.gen->getModel();
+			ModelDiff d = CompiledGrammar::diff(old, model);
+			auto result = std::make_unique<WorkerResult>();
+			result->kind = WorkerResult::RELOADED;
+			result->job = job.id;
+			result->gen = job.gen;
+
+			// Angles changed with the keys count as edits too
+			bool angles = model.info().angle1 != job.gen->angle1 || model.info().angle2 != job.gen->angle2;
+			unsigned int strings = job.gen->firstAffected(d);
+			bool geometry = angles || d.flags;
+			a.iters = d.iters ? std::max(1u, model.info().iters) : job.iter;
+			a.next = std::min(std::min(strings, a.iters), job.iter);
+			if (geometry)
+				a.next = 0;
+			else if (d.colors && a.next > 0) {
+				// Kept iterations only need new colours
+				result->recolor = true;
+				for (int i = 0; i < 4; i++) {
+					result->oldColors[i] = old.color(i);
+					result->newColors[i] = model.color(i);
+				}
+			}
+			result->keep = a.next;
+			if (!d.same || angles)
+				job.gen->setModel(std::move(model), strings);
+			a.done = std::move(result);
+		}
+
+		for (; a.next < a.iters; a.next++) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				currentIter = a.next;
+			}
+			if (!produce(a, a.next, deadline, geom))
+				return false;
+			postIter(std::move(geom));
+		}
+		post(std::move(a.done), *a.ctl);
+		return true; }
+
+	case Job::UPDATE:
+		job.gen->angle1 = job.angle1;
+		job.gen->angle2 = job.angle2;
+		// Fall through
+	case Job::ITERATE:
+		if (!produce(a, job.iter, deadline, geom))
+			return false;
+		postIter(std::move(geom));
+		return true;
+
+	case Job::TRIM:
+		job.gen->truncateStrings(job.iter);
+		return true;
+
+	case Job::ADAPT:
+		job.gen->angle1 = job.angle1;
+		job.gen->angle2 = job.angle2;
+		if (!produce(a, job.iter, deadline, geom))
+			return false;
+		postIter(std::move(geom));
+		return true;
+	}
+	return true;
+}
+
+// The worker thread generates each iteration in one go; unthreaded
+// workers keep a GenerationTask going across calls instead
+bool GenerationWorker::produce(Active& a, unsigned int iter,
+	std::chrono::steady_clock::time_point deadline, IterGeometry& geom) {
+
+	bool adapt = a.job.kind == Job::ADAPT;
+	if (threaded) {
+		geom = adapt ? a.job.gen->generateAdaptive(iter, a.job.viewPixels, a.job.threshold, a.ctl.get()) :
+			a.job.gen->generate(iter, a.ctl.get());
+		return true;
+	}
+	if (!a.task && adapt)
+		a.task.reset(new GenerationTask(a.job.gen, iter, a.job.viewPixels, a.job.threshold, a.ctl.get()));
+	else if (!a.task)
+		a.task.reset(new GenerationTask(a.job.gen, iter, a.ctl.get()));
+	if (!a.task->step(deadline))
+		return false;
+	geom = a.task->take();
+	a.task.reset();
+	return true;
+}
+
+// Wait for room in the result queue, giving up if the job is cancelled
+// Unthreaded workers are drained by their own thread, so they never wait
+void GenerationWorker::post(std::unique_ptr<WorkerResult> result, const JobControl& ctl) {
+	if (!threaded) {
+		if (!overflow.empty() || !results.push(result))
+			overflow.push_back(std::move(result));
+		return;
+	}
+	while (!results.push(result)) {
+		if (ctl.cancelled) return;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
@@ -0,0 +1,140 @@
+#ifndef WORKER_HPP
+#define WORKER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "generator.hpp"
+#include "spsc_queue.hpp"
+
+// Output of a worker job, handed to the render thread for upload
+struct WorkerResult {
+	enum Kind {
+		ITERATION,				// Geometry for one iteration is ready
+		LOADED,					// A load job generated all its iterations
+		RELOADED,				// A reload job sent every iteration that changed
+		FAILED					// The job stopped with an error
+	};
+
+	Kind kind;
+	unsigned int job;			// Id returned when the job was submitted
+	std::shared_ptr<Generator> gen;		// Generator the job ran on
+	IterGeometry geom;			// ITERATION only
+	std::string error;			// FAILED only
+
+	// RELOADED only: iterations before keep are unchanged, apart from
+	// recolouring when recolor is set; the rest were sent as ITERATIONs
+	unsigned int keep = 0;
+	bool recolor = false;
+	glm::vec3 oldColors[4];
+	glm::vec3 newColors[4];
+};
+
+// Runs generation jobs on a background thread, one at a time in order.
+// Finished geometry comes back through a lock-free queue that the render
+// thread drains with poll(). A Generator handed to the worker must not be
+// used elsewhere until its jobs have finished or been cancelled.
+// An unthreaded worker instead runs its jobs in slices from runFor(),
+// keeping their progress between calls.
+class GenerationWorker {
+public:
+	explicit GenerationWorker(bool threaded = true);
+	~GenerationWorker();
+	GenerationWorker(const GenerationWorker& other) = delete;
+	GenerationWorker& operator=(const GenerationWorker& other) = delete;
+
+	// Parse a model file and generate its iterations
+	unsigned int load(const std::string& filename, unsigned int seed, GeometryCache* cache);
+	// Generate iteration iter of a loaded model
+	unsigned int iterate(std::shared_ptr<Generator> gen, unsigned int iter);
+	// Regenerate iteration iter with new angles
+	unsigned int update(std::shared_ptr<Generator> gen, unsigned int iter, float angle1, float angle2);
+	// Generate iteration iter for a view viewPixels from centre to edge,
+	// leaving out detail smaller than threshold pixels (see
+	// Generator::generateAdaptive)
+	unsigned int adapt(std::shared_ptr<Generator> gen, unsigned int iter, float angle1, float angle2,
+		float viewPixels, float threshold);
+	// Reparse a model's file and regenerate only what the edit changed
+	// iters is the number of iterations the caller has
+	unsigned int reload(std::shared_ptr<Generator> gen, const std::string& filename, unsigned int iters);
+	// Drop gen's derived strings from iteration keep on, once the jobs
+	// before this one are done (see Generator::truncateStrings)
+	unsigned int trim(std::shared_ptr<Generator> gen, unsigned int keep);
+	// Stop the running job and drop queued jobs and their unread results
+	// A running reload is waited for, as it switches its Generator's model
+	// Queued trims are kept, as they only free memory
+	void cancel();
+	// Unthreaded workers: run jobs on the calling thread for about budget
+	void runFor(std::chrono::steady_clock::duration budget);
+
+	// Next finished result, or null (render thread only)
+	std::unique_ptr<WorkerResult> poll();
+	// Is a job queued or running?
+	bool busy() const;
+	// Short description of the running job's progress
+	std::string status() const;
+
+private:
+	struct Job {
+		enum Kind { LOAD, ITERATE, UPDATE, ADAPT, RELOAD, TRIM };
+
+		Kind kind;
+		unsigned int id;
+		std::string filename;				// LOAD and RELOAD
+		unsigned int seed;					// LOAD
+		GeometryCache* cache;				// LOAD
+		std::shared_ptr<Generator> gen;		// All but LOAD
+		unsigned int iter;					// ITERATE, UPDATE and ADAPT; iterations held for RELOAD;
+											// strings kept for TRIM
+		float angle1;						// UPDATE and ADAPT
+		float angle2;
+		float viewPixels;					// ADAPT
+		float threshold;
+	};
+
+	// A job being worked on and how far it has got
+	struct Active {
+		Job job;
+		std::shared_ptr<JobControl> ctl;
+		unsigned int next = 0;				// LOAD, RELOAD: next iteration to generate
+		unsigned int iters = 0;				// LOAD, RELOAD: iterations to end up with
+		std::unique_ptr<WorkerResult> done;	// RELOAD: result to post at the end
+		std::unique_ptr<GenerationTask> task;	// Unthreaded: iteration in progress
+	};
+
+	void run();							// Worker thread loop
+	std::unique_ptr<Active> start();	// Take the next job, or null if none
+	// Report a failed job; a failed ITERATE drops queued later iterations
+	void fail(Active& active, const std::exception& e);
+	// Work on a job until the deadline; true once it is finished
+	bool advance(Active& active, std::chrono::steady_clock::time_point deadline);
+	// Generate one iteration; false if the deadline passed first
+	bool produce(Active& active, unsigned int iter,
+		std::chrono::steady_clock::time_point deadline, IterGeometry& geom);
+	unsigned int submit(Job job);
+	void post(std::unique_ptr<WorkerResult> result, const JobControl& ctl);
+
+	bool threaded;
+	std::thread thread;
+	mutable std::mutex mutex;			// Guards everything below except results
+	std::condition_variable wake;
+	std::condition_variable idle;		// Signalled when the running job ends
+	std::deque<Job> jobs;				// Queued jobs
+	std::shared_ptr<JobControl> current;	// Control of the running job, if any
+	unsigned int currentIter;			// Iteration the running job is on
+	bool currentReload;					// Is the running job a RELOAD?
+	unsigned int nextId;
+	bool quit;
+	std::atomic<unsigned int> cancelledId;	// Results from jobs up to this id are dropped
+
+	SpscQueue<std::unique_ptr<WorkerResult>, 64> results;
+	std::unique_ptr<Active> active;		// Unthreaded: job carried between runFor() calls
+	std::deque<std::unique_ptr<WorkerResult>> overflow;	// Unthreaded: results beyond the queue
+};
+
+#endif